@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "auditlog.h"
+#include "keyseq.h"
+
+// Every audit log file starts with this and the size of a record
+static constexpr char file_magic[8] = {'P', 'V', 'K', 'B', 'A', 'U', 'D', '2'};
+
+std::atomic<AuditLog *> AuditLog::installed_{nullptr};
+std::atomic<int> AuditLog::users_{0};
+
+// Copies str into a fixed size field, cut short if needed and always terminated
+template <size_t N>
+static void copy_field(char (&field)[N], const std::string &str) {
+    const size_t n = std::min(str.length(), N - 1);
+    std::memcpy(field, str.data(), n);
+    std::memset(field + n, 0, N - n);
+}
+
+AuditRecord make_audit_record(const PutAction &action, std::optional<double> sent, bool ok,
+			      std::chrono::steady_clock::time_point started) {
+    AuditRecord record{};
+    record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::system_clock::now().time_since_epoch()).count();
+    record.latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now() - started).count();
+    record.key = action.key;
+    if (action.key >= sequence_code_base) {
+	copy_field(record.sequence, key_label(action.key));
+    }
+    record.flags = (action.increment ? audit_increment : 0) | (action.urgent ? audit_urgent : 0)
+	| (ok ? 0 : audit_failed) | (sent ? audit_resolved : 0);
+    copy_field(record.pv, action.pv_name);
+
+    if (auto arr = std::get_if<std::vector<double>>(&action.value)) {
+	record.type = AuditValue::array;
+	record.value = static_cast<double>(arr->size());
+    } else if (auto str = std::get_if<std::string>(&action.value)) {
+	record.type = AuditValue::string;
+	copy_field(record.text, *str);
+    } else if (auto flag = std::get_if<bool>(&action.value)) {
+	record.type = AuditValue::boolean;
+	record.value = *flag ? 1.0 : 0.0;
+    } else {
+	record.type = AuditValue::number;
+	record.value = sent ? *sent : std::holds_alternative<int>(action.value) ? std::get<int>(action.value)
+									       : std::get<double>(action.value);
+    }
+    return record;
+}
+
+AuditLog::AuditLog(const std::string &path, size_t max_bytes, unsigned files)
+    : path_(path), max_bytes_(max_bytes), files_(std::max(1u, files)) {
+    open();
+    thread_ = std::thread(&AuditLog::run, this);
+}
+
+AuditLog::~AuditLog() {
+    AuditLog *self = this;
+    installed_.compare_exchange_strong(self, nullptr);
+    // A put completing meanwhile may have loaded the pointer just before, or
+    // before another log was installed. Both are sequentially consistent,
+    // so such a put is counted in users_ by now
+    while (users_.load() > 0) {
+	std::this_thread::yield();
+    }
+    stop_ = true;
+    thread_.join();
+}
+
+bool AuditLog::record(const AuditRecord &record) {
+    if (ring_.push(record)) {
+	return true;
+    }
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void AuditLog::install(AuditLog *log) {
+    installed_.store(log);
+}
+
+void AuditLog::run() {
+    AuditRecord batch[256];
+    while (true) {
+	// Read stop_ before draining, so nothing pushed before the
+	// destructor ran is left behind
+	const bool stopping = stop_;
+	const size_t n = ring_.pop(batch, std::size(batch));
+	if (n > 0) {
+	    const size_t bytes = n * sizeof(AuditRecord);
+	    if (size_ + bytes > max_bytes_ and size_ > sizeof(file_magic) + sizeof(uint32_t)) {
+		rotate();
+	    }
+	    if (out_.is_open()) {
+		out_.write(reinterpret_cast<const char *>(batch), static_cast<std::streamsize>(bytes));
+		out_.flush();
+		size_ += bytes;
+		written_.fetch_add(n, std::memory_order_relaxed);
+	    } else {
+		dropped_.fetch_add(n, std::memory_order_relaxed);
+	    }
+	} else if (stopping) {
+	    break;
+	} else {
+	    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+    }
+}
+
+void AuditLog::open() {
+    out_.open(path_, std::ios::binary | std::ios::app);
+    if (not out_) {
+	throw std::runtime_error("Cannot open audit log " + path_);
+    }
+    out_.seekp(0, std::ios::end);
+    size_ = static_cast<size_t>(out_.tellp());
+    if (size_ == 0) {
+	const uint32_t record_size = sizeof(AuditRecord);
+	out_.write(file_magic, sizeof(file_magic));
+	out_.write(reinterpret_cast<const char *>(&record_size), sizeof(record_size));
+	size_ = sizeof(file_magic) + sizeof(record_size);
+    }
+}
+
+void AuditLog::rotate() {
+    out_.close();
+    for (unsigned i = files_ - 1; i > 0; i--) {
+	const std::string from = i == 1 ? path_ : path_ + "." + std::to_string(i - 1);
+	std::rename(from.c_str(), (path_ + "." + std::to_string(i)).c_str());
+    }
+    if (files_ == 1) {
+	std::remove(path_.c_str());
+    }
+    try {
+	open();
+    } catch (const std::exception &e) {
+	// Records are counted as dropped until the program restarts
+	out_.close();
+    }
+}
+
+void dump_audit_log(const std::string &path, std::ostream &out) {
+    std::ifstream in(path, std::ios::binary);
+    if (not in) {
+	throw std::runtime_error("Cannot open " + path);
+    }
+    char magic[sizeof(file_magic)];
+    uint32_t record_size = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&record_size), sizeof(record_size));
+    if (not in or std::memcmp(magic, file_magic, sizeof(magic)) != 0 or record_size != sizeof(AuditRecord)) {
+	throw std::runtime_error(path + " is not a pvkb audit log");
+    }
+
+    AuditRecord record;
+    while (in.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+	record.pv[sizeof(record.pv) - 1] = '\0';
+	record.text[sizeof(record.text) - 1] = '\0';
+	record.sequence[sizeof(record.sequence) - 1] = '\0';
+
+	const std::time_t seconds = static_cast<std::time_t>(record.time_ns / 1000000000);
+	std::tm local{};
+	localtime_r(&seconds, &local);
+	std::ostringstream line;
+	line << std::put_time(&local, "%Y-%m-%d %H:%M:%S") << "." << std::setw(6) << std::setfill('0')
+	     << (record.time_ns % 1000000000) / 1000 << std::setfill(' ') << " key="
+	     << (record.sequence[0] ? std::string(record.sequence) : key_label(record.key)) << " " << record.pv;
+	const bool relative = (record.flags & audit_increment) and not (record.flags & audit_resolved);
+	line << (relative ? " += " : " = ");
+	switch (record.type) {
+	case AuditValue::array:
+	    line << "[" << static_cast<size_t>(record.value) << " values]";
+	    break;
+	case AuditValue::string:
+	    line << '"' << record.text << '"';
+	    break;
+	case AuditValue::boolean:
+	    line << (record.value != 0.0 ? "true" : "false");
+	    break;
+	case AuditValue::number:
+	    line << record.value;
+	    break;
+	}
+	line << ((record.flags & audit_increment) and not relative ? " (increment)" : "")
+	     << (record.flags & audit_urgent ? " urgent" : "") << (record.flags & audit_failed ? " FAILED" : " ok")
+	     << " " << std::fixed << std::setprecision(1) << record.latency_ns / 1e6 << " ms";
+	out << line.str() << "\n";
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef PVKB_AUDITLOG_H
+#define PVKB_AUDITLOG_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include "mpscring.h"
+#include "putops.h"
+
+// What an AuditRecord's value is
+enum class AuditValue : uint8_t {number, boolean, string, array};
+
+// Flags of an AuditRecord
+constexpr uint8_t audit_increment = 1;
+constexpr uint8_t audit_urgent = 2;
+constexpr uint8_t audit_failed = 4;
+constexpr uint8_t audit_resolved = 8; // value is the result of an increment, not the step
+
+// One completed put as stored in the audit log. Fixed size and trivially
+// copyable, so it goes through the ring and into the file as is
+struct AuditRecord {
+    int64_t time_ns; // wall clock when the put completed, since the epoch
+    int64_t latency_ns; // from issuing the put until it completed
+    double value; // the number written or added, or the length of an array
+    int32_t key; // key code of the binding, 0 for the put list
+    AuditValue type;
+    uint8_t flags;
+    char pv[64]; // PV name, cut short if longer
+    char text[34]; // string value, cut short if longer
+    char sequence[32]; // keys of a sequence binding, e.g. "g m 1", as codes differ between runs
+};
+static_assert(std::is_trivially_copyable_v<AuditRecord>, "AuditRecord is written to the file byte for byte");
+static_assert(sizeof(AuditRecord) == 160, "AuditRecord layout changed, bump the file version");
+
+// Returns the record of a completed put. sent is the number actually
+// written when it differs from the action's value, i.e. for increments
+AuditRecord make_audit_record(const PutAction &action, std::optional<double> sent, bool ok,
+			      std::chrono::steady_clock::time_point started);
+
+// Records every completed put to a binary log file, rotated once it grows
+// past max_bytes into path.1, path.2, ... keeping files logs in all.
+// Puts complete on pvAccess worker threads, which only copy the record
+// into a lock-free ring. A writer thread drains the ring to the file, so
+// no disk access ever happens on the keypress path. When the ring is full
+// records are dropped and counted rather than waited for
+class AuditLog {
+  public:
+    // Opens path for appending. Throws if it cannot be opened
+    AuditLog(const std::string &path, size_t max_bytes, unsigned files);
+
+    // Writes every queued record, then stops the writer thread
+    ~AuditLog();
+
+    AuditLog(const AuditLog &) = delete;
+    AuditLog &operator=(const AuditLog &) = delete;
+
+    // Queues a record for writing, never blocks. Returns false if the ring was full
+    bool record(const AuditRecord &record);
+
+    size_t written() const { return written_.load(std::memory_order_relaxed); }
+    size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Makes log the one completed puts are recorded to, nullptr for none
+    static void install(AuditLog *log);
+
+    // Calls f with the log installed with install(), if there is one.
+    // The log is not destroyed before f returns, see ~AuditLog
+    template <typename F>
+    static void with_installed(F &&f) {
+	users_.fetch_add(1);
+	if (AuditLog *log = installed_.load()) {
+	    f(*log);
+	}
+	users_.fetch_sub(1);
+    }
+
+    static constexpr size_t ring_capacity = 4096;
+
+  private:
+    // Writer thread: drains the ring until stopped and empty
+    void run();
+
+    // Opens path_, writing the file header if it is new
+    void open();
+
+    // Moves path_ to path_.1, path_.1 to path_.2 and so on, and opens a new path_
+    void rotate();
+
+    const std::string path_;
+    const size_t max_bytes_;
+    const unsigned files_;
+    std::ofstream out_;
+    size_t size_ = 0;
+
+    MpscRing<AuditRecord, ring_capacity> ring_;
+    std::atomic<size_t> written_{0};
+    std::atomic<size_t> dropped_{0};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+
+    static std::atomic<AuditLog *> installed_;
+    static std::atomic<int> users_; // calls of with_installed() in progress
+};
+
+// Prints every record of an audit log file, one line each, for
+// 'pvkb log-dump'. Throws if the file is not an audit log
+void dump_audit_log(const std::string &path, std::ostream &out);
+
+#endif
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+
+#include "configload.h"
+
+// Returns where a node was parsed, e.g. "common/motors.toml:12"
+static std::string location(const toml::node &node) {
+    const toml::source_region &source = node.source();
+    return (source.path ? *source.path : std::string("?")) + ":" + std::to_string(source.begin.line);
+}
+
+// Returns true for tables written as [name] headers, which are merged
+// rather than replaced. Inline tables like {pv=..., value=...} are values
+static bool is_section(const toml::node &node) {
+    return node.is_table() and not node.as_table()->is_inline();
+}
+
+// Records where node and, for a section, everything in it was set
+static void record_locations(const toml::node &node, const std::string &key_path,
+			     std::map<std::string, std::string> &locations) {
+    locations[key_path] = location(node);
+    if (is_section(node)) {
+	for (const auto &[key, value] : *node.as_table()) {
+	    record_locations(value, key_path + "." + std::string(key.str()), locations);
+	}
+    }
+}
+
+// Merges the keys of src, other than a top level include, into dst, see ConfigLoader
+static void merge_table(toml::table &dst, const toml::table &src, const std::string &key_path,
+			std::map<std::string, std::string> &locations) {
+    for (const auto &[key, value] : src) {
+	const std::string name(key.str());
+	if (key_path.empty() and name == "include") {
+	    continue;
+	}
+	const std::string child_path = key_path.empty() ? name : key_path + "." + name;
+	toml::node *existing = dst.get(name);
+	if (!existing) {
+	    dst.insert(name, value);
+	    record_locations(value, child_path, locations);
+	} else if (is_section(*existing) and is_section(value)) {
+	    merge_table(*existing->as_table(), *value.as_table(), child_path, locations);
+	} else if (existing->is_array() and value.is_array() and (name == "put" or name == "template")) {
+	    for (const auto &item : *value.as_array()) {
+		existing->as_array()->push_back(item);
+	    }
+	} else {
+	    throw std::runtime_error("Conflicting " + child_path + " at " + location(value)
+				     + " and " + locations[child_path]);
+	}
+    }
+}
+
+toml::table ConfigLoader::load(const std::string &path) {
+    files_.clear();
+    read_.clear();
+    locations_.clear();
+    parsed_ = 0;
+
+    toml::table merged;
+    std::vector<std::string> stack;
+    merge_file(std::filesystem::path(path).lexically_normal().string(), merged, stack);
+
+    // Forget the files which are no longer included
+    for (auto it = cache_.begin(); it != cache_.end();) {
+	if (std::find(files_.begin(), files_.end(), it->first) == files_.end()) {
+	    it = cache_.erase(it);
+	} else {
+	    ++it;
+	}
+    }
+    return merged;
+}
+
+bool ConfigLoader::stale() const {
+    for (const auto &path : files_) {
+	std::error_code ec;
+	const std::filesystem::file_time_type mtime = std::filesystem::last_write_time(path, ec);
+	auto it = read_.find(path);
+	const bool existed = it != read_.end();
+	if (ec ? existed : (not existed or it->second != mtime)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+std::shared_ptr<const toml::table> ConfigLoader::fragment(const std::string &path) {
+    std::error_code ec;
+    const std::filesystem::file_time_type mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+	throw std::runtime_error("Cannot read " + path + ": " + ec.message());
+    }
+    read_[path] = mtime;
+
+    auto it = cache_.find(path);
+    if (it != cache_.end() and it->second.mtime == mtime) {
+	return it->second.table;
+    }
+    auto table = std::make_shared<const toml::table>(toml::parse_file(path));
+    cache_[path] = Fragment{mtime, table};
+    parsed_++;
+    return table;
+}
+
+void ConfigLoader::merge_file(const std::string &path, toml::table &merged, std::vector<std::string> &stack) {
+    if (std::find(stack.begin(), stack.end(), path) != stack.end()) {
+	std::string chain;
+	for (const auto &file : stack) {
+	    chain += file + " -> ";
+	}
+	throw std::runtime_error("Include cycle: " + chain + path);
+    }
+    // A file included twice, e.g. by two fragments, is only merged once
+    if (std::find(files_.begin(), files_.end(), path) != files_.end()) {
+	return;
+    }
+    files_.push_back(path);
+
+    const std::shared_ptr<const toml::table> table = fragment(path);
+    stack.push_back(path);
+    if (const toml::node *include = table->get("include")) {
+	std::vector<std::string> includes;
+	if (auto include_path = include->value<std::string>()) {
+	    includes.push_back(*include_path);
+	} else if (auto include_array = include->as_array()) {
+	    for (const auto &item : *include_array) {
+		auto include_path = item.value<std::string>();
+		if (not include_path) {
+		    throw std::runtime_error("include must only contain file names, at " + location(item));
+		}
+		includes.push_back(*include_path);
+	    }
+	} else {
+	    throw std::runtime_error("include must be a file name or a list of them, at " + location(*include));
+	}
+
+	const std::filesystem::path dir = std::filesystem::path(path).parent_path();
+	for (const auto &include_path : includes) {
+	    merge_file((dir / include_path).lexically_normal().string(), merged, stack);
+	}
+    }
+    stack.pop_back();
+
+    merge_table(merged, *table, "", locations_);
+}
@@ -0,0 +1,60 @@
+#ifndef PVKB_CONFIGLOAD_H
+#define PVKB_CONFIGLOAD_H
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "toml++/toml.hpp"
+
+// Loads a config file together with the fragments it includes, e.g.
+// include = ["common/motors.toml"]. Include paths are relative to the file
+// which includes them, and included files may include others.
+// Each file is parsed once and kept with its modification time, so loading
+// again only re-parses the files which changed since.
+// Fragments are merged key by key: tables are merged, the put and template
+// lists are joined in include order, and a key set by two files is a
+// conflict which is reported with the file and line of both
+class ConfigLoader {
+  public:
+    // Returns the merged config. Throws toml::parse_error if a file does not
+    // parse and std::runtime_error for conflicts, missing files and include cycles
+    toml::table load(const std::string &path);
+
+    // Returns every file read by the last load(), the config file first
+    const std::vector<std::string> &files() const { return files_; }
+
+    // Returns how many files the last load() parsed rather than took from the cache
+    size_t parsed() const { return parsed_; }
+
+    // Returns true if any file read by the last load() was written, created
+    // or removed since, i.e. loading again would give a different result
+    bool stale() const;
+
+  private:
+    struct Fragment {
+	std::filesystem::file_time_type mtime;
+	std::shared_ptr<const toml::table> table;
+    };
+
+    // Returns the parsed file, from the cache if it did not change
+    std::shared_ptr<const toml::table> fragment(const std::string &path);
+
+    // Merges a file, after the files it includes, into merged.
+    // stack holds the chain of files including it
+    void merge_file(const std::string &path, toml::table &merged, std::vector<std::string> &stack);
+
+    std::map<std::string, Fragment> cache_;
+    std::vector<std::string> files_;
+    size_t parsed_ = 0;
+    // Modification time of each file when the last load() read it, files which did not exist are left out
+    std::map<std::string, std::filesystem::file_time_type> read_;
+
+    // Where each merged key was set, as "file:line", by dotted key path
+    std::map<std::string, std::string> locations_;
+};
+
+#endif
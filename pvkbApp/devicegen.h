@@ -0,0 +1,48 @@
+#ifndef PVKB_DEVICEGEN_H
+#define PVKB_DEVICEGEN_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Generation counters of the devices urgent bindings write to, so a press
+// queued before an urgent stop of its device is dropped rather than sent
+// after the stop. Every queued press is stamped with current(); firing an
+// urgent binding bumps the generation of its devices. A press whose stamp
+// is still current cannot have been superseded, so the lock is only taken
+// for presses queued before some urgent binding fired
+class DeviceGenerations {
+  public:
+    // Returns the stamp of a press queued now
+    uint64_t current() const { return current_.load(std::memory_order_acquire); }
+
+    // Supersedes every press stamped before now which writes to one of devices
+    void bump(const std::vector<std::string> &devices) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	const uint64_t generation = current_.load(std::memory_order_relaxed) + 1;
+	for (const auto &device : devices) {
+	    bumped_[device] = generation;
+	}
+	current_.store(generation, std::memory_order_release);
+    }
+
+    // Returns true if device was bumped after a press stamped with stamp
+    bool superseded(uint64_t stamp, const std::string &device) const {
+	if (stamp == current()) {
+	    return false;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = bumped_.find(device);
+	return it != bumped_.end() and it->second > stamp;
+    }
+
+  private:
+    std::atomic<uint64_t> current_{0};
+    mutable std::mutex mutex_;
+    std::map<std::string, uint64_t> bumped_; // generation each device was last bumped at
+};
+
+#endif
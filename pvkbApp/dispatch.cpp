@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+
+#include "dispatch.h"
+#include "metrics.h"
+
+DispatchTable::DispatchTable(const BindingMap &bindings) {
+    for (const auto &[key, binding] : bindings) {
+	if (key >= 0 and key < dense_keys) {
+	    dense_[key] = &binding;
+	} else {
+	    sparse_.emplace(key, &binding);
+	}
+    }
+}
+
+Layer::Layer(std::string name, int key, BindingMap bindings)
+    : name(std::move(name)), key(key), bindings(std::move(bindings)), table(this->bindings) {}
+
+std::optional<size_t> Keymap::layer_of(int key) const {
+    for (size_t i = 1; i < layers.size(); i++) {
+	if (layers[i]->key == key) {
+	    return i;
+	}
+    }
+    return std::nullopt;
+}
+
+void StatusLine::set(const std::string &msg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    msg_ = msg;
+    dirty_ = true;
+}
+
+std::optional<std::string> StatusLine::take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not dirty_) {
+	return std::nullopt;
+    }
+    dirty_ = false;
+    return msg_;
+}
+
+std::string format_errors(const std::vector<std::string> &errors, size_t total) {
+    std::string msg = "Put failed: " + errors.front();
+    if (errors.size() > 1) {
+	msg += " (+" + std::to_string(errors.size() - 1) + " more";
+	msg += ", " + std::to_string(errors.size()) + "/" + std::to_string(total) + " targets failed)";
+    }
+    return msg;
+}
+
+void TokenBucket::refill(double rate, double burst, std::chrono::steady_clock::time_point now) {
+    if (tokens_ < 0.0) {
+	tokens_ = burst;
+    } else if (now > last_) {
+	tokens_ = std::min(burst, tokens_ + rate * std::chrono::duration<double>(now - last_).count());
+    }
+    last_ = std::max(last_, now);
+}
+
+std::chrono::steady_clock::duration TokenBucket::until_ready(double rate) const {
+    if (ready()) {
+	return std::chrono::steady_clock::duration::zero();
+    }
+    // Rounded up, so waking up after it always finds the token there
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+	std::chrono::duration<double>((1.0 - tokens_) / rate)) + std::chrono::microseconds(1);
+}
+
+// Returns a binding which does what presses presses of it do, with the
+// increments multiplied and absolute values written once
+static Binding coalesced(const Binding &binding, unsigned presses) {
+    Binding result = binding;
+    for (auto &action : result.actions) {
+	if (not action.increment) {
+	    continue;
+	}
+	std::visit([presses](auto &value) {
+	    using T = std::decay_t<decltype(value)>;
+	    if constexpr (std::is_same_v<T, std::vector<double>>) {
+		for (auto &element : value) {
+		    element *= presses;
+		}
+	    } else if constexpr (std::is_same_v<T, int> or std::is_same_v<T, double>) {
+		value *= static_cast<T>(presses);
+	    }
+	}, action.value);
+    }
+    return result;
+}
+
+void dispatch_binding(const Binding &binding, std::chrono::steady_clock::time_point pressed,
+		      PutScheduler &scheduler, LatencyStats &latency, StatusLine &status, UndoStack *undo) {
+    const bool urgent = binding.urgent;
+    const size_t total = binding.actions.size();
+
+    // Increments of a PV already at the limit they move towards are not sent
+    std::vector<bool> pinned(binding.actions.size());
+    std::string pinned_msg;
+    for (size_t i = 0; i < binding.actions.size(); i++) {
+	if (auto limit = pinned_limit(binding.actions[i])) {
+	    pinned[i] = true;
+	    std::ostringstream ss;
+	    ss << (pinned_msg.empty() ? "At limit, not sent: " : ", ") << binding.actions[i].pv_name << " = " << *limit;
+	    pinned_msg += ss.str();
+	}
+    }
+
+    auto barrier = std::make_shared<PutBarrier>([pressed, urgent, total, pinned_msg, &latency, &status](const auto &errors) {
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - pressed).count();
+	latency.record(seconds);
+	if (not errors.empty()) {
+	    status.set(format_errors(errors, total));
+	} else if (not pinned_msg.empty()) {
+	    status.set(pinned_msg);
+	} else if (urgent) {
+	    status.set("Urgent put completed in " + std::to_string(static_cast<int>(seconds * 1e3)) + " ms");
+	} else {
+	    status.set("");
+	}
+    });
+
+    // Only puts actually sent can be undone
+    if (undo and pinned_msg.empty()) {
+	undo->record(binding.actions, pressed);
+    } else if (undo) {
+	std::vector<PutAction> sent;
+	for (size_t i = 0; i < binding.actions.size(); i++) {
+	    if (not pinned[i]) {
+		sent.push_back(binding.actions[i]);
+	    }
+	}
+	if (not sent.empty()) {
+	    undo->record(sent, pressed);
+	}
+    }
+    for (size_t i = 0; i < binding.actions.size(); i++) {
+	if (binding.actions[i].urgent and not pinned[i]) {
+	    scheduler.submit_urgent(binding.actions[i], barrier);
+	}
+    }
+    for (size_t i = 0; i < binding.actions.size(); i++) {
+	if (not binding.actions[i].urgent and not pinned[i]) {
+	    scheduler.submit(binding.actions[i], barrier);
+	}
+    }
+    barrier->seal();
+}
+
+KeyDispatcher::KeyDispatcher(const BindingTable &bindings, PutScheduler &scheduler,
+			     LatencyStats &latency, StatusLine &status, UndoStack *undo)
+    : bindings_(bindings), scheduler_(scheduler), latency_(latency), status_(status), undo_(undo),
+      thread_(&KeyDispatcher::run, this) {}
+
+KeyDispatcher::~KeyDispatcher() {
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+bool KeyDispatcher::post(int key, KeyEventType type, size_t layer) {
+    if (not ring_.push(KeyEvent{key, type, layer, std::chrono::steady_clock::now(), generations_.current()})) {
+	dropped_.fetch_add(1, std::memory_order_relaxed);
+	return false;
+    }
+    // Pairs with the fence in run(): either we see sleeping_ or the
+    // dispatcher sees the event, as the ring's release/acquire alone does
+    // not order a store before a later load
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load()) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	cv_.notify_one();
+    }
+    return true;
+}
+
+void KeyDispatcher::supersede(const Binding &binding) {
+    std::vector<std::string> devices;
+    for (const auto &action : binding.actions) {
+	devices.push_back(device_of(action.pv_name));
+    }
+    generations_.bump(devices);
+}
+
+bool KeyDispatcher::superseded(const Binding &binding, uint64_t generation) const {
+    if (generation == generations_.current()) {
+	return false;
+    }
+    for (const auto &action : binding.actions) {
+	if (generations_.superseded(generation, device_of(action.pv_name))) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+void KeyDispatcher::run() {
+    static constexpr size_t batch_size = 32;
+    KeyEvent batch[batch_size];
+
+    while (not stop_) {
+	const size_t n = ring_.pop(batch, batch_size);
+	const std::shared_ptr<const Keymap> keymap = n > 0 ? bindings_.load() : nullptr;
+	for (size_t i = 0; i < n; i++) {
+	    const Binding *binding = keymap->find(batch[i].layer, batch[i].key);
+	    if (binding == nullptr) {
+		continue;
+	    } else if (binding->hold and batch[i].type == KeyEventType::release) {
+		release_hold(batch[i].key, batch[i].pressed);
+	    } else if (superseded(*binding, batch[i].generation)) {
+		continue;
+	    } else if (binding->hold) {
+		press_hold(batch[i].key, *binding, batch[i].pressed);
+	    } else if (batch[i].type != KeyEventType::release) {
+		press(*keymap, batch[i].key, *binding, batch[i].pressed, batch[i].generation);
+	    }
+	}
+	const auto next_release = std::min(release_holds(), flush_deferred());
+	scheduler_.expire(3.0);
+
+	if (n == 0) {
+	    // Recheck after announcing we are asleep, so a post() racing with
+	    // us is never missed. The timeout keeps expire() and the hold
+	    // watchdogs running
+	    std::unique_lock<std::mutex> lock(mutex_);
+	    sleeping_ = true;
+	    std::atomic_thread_fence(std::memory_order_seq_cst);
+	    if (ring_.size() == 0 and not stop_) {
+		cv_.wait_for(lock, std::min<std::chrono::steady_clock::duration>(next_release,
+										 std::chrono::milliseconds(100)));
+	    }
+	    sleeping_ = false;
+	}
+    }
+
+    // Never leave a jog running after the program exits
+    std::vector<PutAction> stop_actions;
+    for (const auto &[key, hold] : holds_) {
+	stop_actions.insert(stop_actions.end(), hold.release.actions.begin(), hold.release.actions.end());
+    }
+    holds_.clear();
+    if (not stop_actions.empty()) {
+	execute_puts(stop_actions);
+    }
+}
+
+void KeyDispatcher::press(const Keymap &keymap, int key, const Binding &binding,
+			  std::chrono::steady_clock::time_point pressed, uint64_t generation) {
+    // Presses deferred before an urgent stop of their device are dropped
+    auto deferred = deferred_.find(key);
+    if (deferred != deferred_.end() and superseded(deferred->second.binding, deferred->second.generation)) {
+	deferred_.erase(deferred);
+	deferred = deferred_.end();
+    }
+    if (deferred == deferred_.end()
+	and throttle(key, binding, keymap.prefix_rates, pressed) == std::chrono::steady_clock::duration::zero()) {
+	dispatch_binding(binding, pressed, scheduler_, latency_, status_, undo_);
+	return;
+    }
+
+    // Presses join the one already waiting, so they cannot take tokens out of turn
+    throttled_.fetch_add(1, std::memory_order_relaxed);
+    metrics::press_throttled(key);
+    if (not binding.coalesce) {
+	return;
+    } else if (deferred == deferred_.end()) {
+	deferred_.emplace(key, Deferred{binding, 1, pressed, generation});
+    } else {
+	deferred->second.binding = binding;
+	deferred->second.presses++;
+    }
+}
+
+std::chrono::steady_clock::duration KeyDispatcher::throttle(int key, const Binding &binding,
+							    const std::map<std::string, double> &prefix_rates,
+							    std::chrono::steady_clock::time_point now) {
+    if (binding.max_rate <= 0.0 and prefix_rates.empty()) {
+	return std::chrono::steady_clock::duration::zero();
+    }
+
+    // The binding's own bucket, and one for each IOC prefix its puts go to
+    std::vector<std::pair<TokenBucket *, double>> buckets;
+    if (binding.max_rate > 0.0) {
+	TokenBucket &bucket = binding_buckets_[key];
+	bucket.refill(binding.max_rate, binding.burst, now);
+	buckets.emplace_back(&bucket, binding.max_rate);
+    }
+    for (const auto &[prefix, rate] : prefix_rates) {
+	const bool used = std::any_of(binding.actions.begin(), binding.actions.end(), [&](const auto &action) {
+	    return action.pv_name.compare(0, prefix.length(), prefix) == 0;
+	});
+	if (used) {
+	    TokenBucket &bucket = prefix_buckets_[prefix];
+	    bucket.refill(rate, 1.0, now);
+	    buckets.emplace_back(&bucket, rate);
+	}
+    }
+
+    auto wait = std::chrono::steady_clock::duration::zero();
+    for (const auto &[bucket, rate] : buckets) {
+	wait = std::max(wait, bucket->until_ready(rate));
+    }
+    if (wait == std::chrono::steady_clock::duration::zero()) {
+	for (const auto &[bucket, rate] : buckets) {
+	    bucket->take();
+	}
+    }
+    return wait;
+}
+
+std::chrono::steady_clock::duration KeyDispatcher::flush_deferred() {
+    auto next = std::chrono::steady_clock::duration::max();
+    if (deferred_.empty()) {
+	return next;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    const std::shared_ptr<const Keymap> keymap = bindings_.load();
+    for (auto it = deferred_.begin(); it != deferred_.end();) {
+	if (superseded(it->second.binding, it->second.generation)) {
+	    it = deferred_.erase(it);
+	    continue;
+	}
+	const auto wait = throttle(it->first, it->second.binding, keymap->prefix_rates, now);
+	if (wait == std::chrono::steady_clock::duration::zero()) {
+	    dispatch_binding(coalesced(it->second.binding, it->second.presses), it->second.pressed,
+			     scheduler_, latency_, status_, undo_);
+	    it = deferred_.erase(it);
+	} else {
+	    next = std::min(next, wait);
+	    ++it;
+	}
+    }
+    return next;
+}
+
+void KeyDispatcher::press_hold(int key, const Binding &binding, std::chrono::steady_clock::time_point pressed) {
+    auto it = holds_.find(key);
+    if (it != holds_.end()) {
+	it->second.last_seen = pressed;
+	return;
+    }
+
+    // The release puts are copied so a config reload during the hold still ends it
+    Hold hold;
+    hold.release.actions = binding.release_actions;
+    hold.gap = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+	std::chrono::duration<double>(binding.hold_gap));
+    hold.last_seen = pressed;
+    holds_.emplace(key, std::move(hold));
+    dispatch_binding(binding, pressed, scheduler_, latency_, status_, undo_);
+}
+
+void KeyDispatcher::release_hold(int key, std::chrono::steady_clock::time_point released) {
+    auto it = holds_.find(key);
+    if (it != holds_.end()) {
+	// Stopping a hold is never undone, that would restart the motion
+	dispatch_binding(it->second.release, released, scheduler_, latency_, status_);
+	holds_.erase(it);
+    }
+}
+
+std::chrono::steady_clock::duration KeyDispatcher::release_holds() {
+    const auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::duration::max();
+    for (auto it = holds_.begin(); it != holds_.end();) {
+	const auto deadline = it->second.last_seen + it->second.gap;
+	if (now >= deadline) {
+	    dispatch_binding(it->second.release, now, scheduler_, latency_, status_);
+	    it = holds_.erase(it);
+	} else {
+	    next = std::min(next, deadline - now);
+	    ++it;
+	}
+    }
+    return next;
+}
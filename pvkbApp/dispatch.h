@@ -0,0 +1,277 @@
+#ifndef PVKB_DISPATCH_H
+#define PVKB_DISPATCH_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "devicegen.h"
+#include "keyproto.h"
+#include "putops.h"
+#include "spscring.h"
+#include "undo.h"
+
+// A keybinding: one or more puts which are issued together,
+// e.g. key_s = [{pv="m1.STOP", value=1}, {pv="m2.STOP", value=1}]
+struct Binding {
+    std::vector<PutAction> actions;
+    bool urgent = false;
+
+    // A hold binding puts actions on the first press and release_actions when
+    // the key is released. Legacy terminals only report auto-repeat, never
+    // release, so the key also counts as released once no repeat has
+    // arrived for hold_gap seconds
+    bool hold = false;
+    std::vector<PutAction> release_actions;
+    double hold_gap = 0.6;
+
+    // Optional readback PVs shown next to the binding, one per IOC prefix
+    std::vector<std::string> readback_pvs;
+    std::vector<std::shared_ptr<PVCache>> readbacks;
+
+    // Presses beyond max_rate per second (0 for no limit), after a burst of
+    // up to burst presses, are dropped, or with coalesce merged into one
+    // put once the rate allows, with increments summed
+    double max_rate = 0.0;
+    double burst = 1.0;
+    bool coalesce = false;
+};
+
+using BindingMap = std::map<int, Binding>;
+
+// Dense lookup from key code to binding. Plain keys and every ncurses
+// KEY_* code index an array directly, the few bindings above that
+// (modifier combinations and key sequences) are kept in a hash map.
+// Points into the BindingMap it was built from
+class DispatchTable {
+  public:
+    static constexpr int dense_keys = 512; // KEY_MAX is 0777
+
+    explicit DispatchTable(const BindingMap &bindings);
+
+    // Returns the binding of a key, or nullptr if the key is not bound
+    const Binding *find(int key) const {
+	if (key >= 0 and key < dense_keys) {
+	    return dense_[key];
+	}
+	auto it = sparse_.find(key);
+	return it == sparse_.end() ? nullptr : it->second;
+    }
+
+  private:
+    std::array<const Binding *, dense_keys> dense_{};
+    std::unordered_map<int, const Binding *> sparse_;
+};
+
+// A named set of keybindings. Layers rebind keys of the base layer, and
+// switching between them only changes which layer keys are looked up in
+struct Layer {
+    Layer(std::string name, int key, BindingMap bindings);
+
+    Layer(const Layer &) = delete;
+    Layer &operator=(const Layer &) = delete;
+
+    const std::string name;
+    const int key; // switches to this layer, unused for the base layer
+    const BindingMap bindings; // the base layer's bindings with this layer's on top
+    const DispatchTable table;
+};
+
+// All layers of a config, the base layer from [keybindings] first
+struct Keymap {
+    std::vector<std::unique_ptr<const Layer>> layers;
+
+    // Most presses per second sent to the PVs of each IOC prefix
+    std::map<std::string, double> prefix_rates;
+
+    // Returns the binding of a key in a layer, or nullptr
+    const Binding *find(size_t layer, int key) const {
+	return layer < layers.size() ? layers[layer]->table.find(key) : nullptr;
+    }
+
+    // Returns the layer which key switches to, if it is a layer key
+    std::optional<size_t> layer_of(int key) const;
+};
+
+// The live keymap. Readers take a snapshot for each keypress, and a config
+// reload publishes a new keymap with a single atomic pointer swap,
+// so a keypress always sees either the old or the new bindings as a whole
+class BindingTable {
+  public:
+    std::shared_ptr<const Keymap> load() const { return std::atomic_load(&map_); }
+    void store(std::shared_ptr<const Keymap> map) { std::atomic_store(&map_, std::move(map)); }
+
+  private:
+    std::shared_ptr<const Keymap> map_;
+};
+
+// Status message which may be set from any thread and is drawn by the main loop
+class StatusLine {
+  public:
+    void set(const std::string &msg);
+
+    // Returns the message if it changed since the last call
+    std::optional<std::string> take();
+
+  private:
+    std::mutex mutex_;
+    std::string msg_;
+    bool dirty_ = false;
+};
+
+// Returns a one line summary of failed puts out of total puts
+std::string format_errors(const std::vector<std::string> &errors, size_t total);
+
+// Submits every put of a binding without waiting, urgent puts first.
+// Completion of the whole binding is reported to the status line,
+// and its keypress to completion latency to the latency stats.
+// The values the puts overwrite are recorded to undo, unless it is null
+void dispatch_binding(const Binding &binding, std::chrono::steady_clock::time_point pressed,
+		      PutScheduler &scheduler, LatencyStats &latency, StatusLine &status, UndoStack *undo = nullptr);
+
+// Token bucket rate limit. Tokens accrue at rate per second up to burst,
+// and each event which passes takes one
+class TokenBucket {
+  public:
+    // Adds the tokens accrued since the last refill, the first one fills the bucket
+    void refill(double rate, double burst, std::chrono::steady_clock::time_point now);
+
+    // Returns true if an event may pass
+    bool ready() const { return tokens_ >= 1.0; }
+
+    // Takes the token of an event which passed
+    void take() { tokens_ -= 1.0; }
+
+    // Returns how long until an event may pass at rate
+    std::chrono::steady_clock::duration until_ready(double rate) const;
+
+  private:
+    double tokens_ = -1.0;
+    std::chrono::steady_clock::time_point last_;
+};
+
+// Compact key event passed from the input thread to the dispatch thread
+struct KeyEvent {
+    int key;
+    KeyEventType type;
+    size_t layer;
+    std::chrono::steady_clock::time_point pressed;
+    uint64_t generation; // DeviceGenerations stamp when queued
+};
+
+// Submits the puts for key events on a dedicated thread, so that reading the
+// keyboard never waits on pvAccess. The input thread pushes events into a
+// lock-free ring and the dispatch thread drains it in batches.
+// The dispatch thread also runs the watchdogs of held keys, so a hold costs
+// exactly two puts however fast the keyboard repeats.
+class KeyDispatcher {
+  public:
+    static constexpr size_t queue_capacity = 256;
+
+    KeyDispatcher(const BindingTable &bindings, PutScheduler &scheduler,
+		  LatencyStats &latency, StatusLine &status, UndoStack *undo = nullptr);
+    ~KeyDispatcher();
+
+    KeyDispatcher(const KeyDispatcher &) = delete;
+    KeyDispatcher &operator=(const KeyDispatcher &) = delete;
+
+    // Queues a key event, only ever called from the input thread.
+    // Returns false and counts the event as dropped if the queue is full
+    bool post(int key, KeyEventType type = KeyEventType::press, size_t layer = 0);
+
+    // Drops the presses queued or deferred so far which write to a device
+    // the urgent binding writes to, so e.g. a queued jog never follows a
+    // stop. Only called from the input thread, just before it dispatches binding
+    void supersede(const Binding &binding);
+
+    // Returns the number of events waiting to be dispatched
+    size_t depth() const { return ring_.size(); }
+
+    // Returns the deepest the queue has ever been
+    size_t high_water() const { return ring_.high_water(); }
+
+    // Returns the number of events dropped because the queue was full
+    size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Returns the number of presses dropped or coalesced by a rate limit
+    size_t throttled() const { return throttled_.load(std::memory_order_relaxed); }
+
+  private:
+    // A key in hold mode which is still being repeated
+    struct Hold {
+	Binding release;
+	std::chrono::steady_clock::duration gap;
+	std::chrono::steady_clock::time_point last_seen;
+    };
+
+    // Throttled presses of a coalescing binding, sent as one once the rate allows
+    struct Deferred {
+	Binding binding;
+	unsigned presses;
+	std::chrono::steady_clock::time_point pressed;
+	uint64_t generation; // stamp of the first press
+    };
+
+    void run();
+
+    // Returns true if an urgent binding fired after generation writes to a device binding writes to
+    bool superseded(const Binding &binding, uint64_t generation) const;
+
+    // Dispatches a press of a binding which is not a hold, unless a rate limit throttles it
+    void press(const Keymap &keymap, int key, const Binding &binding, std::chrono::steady_clock::time_point pressed,
+	       uint64_t generation);
+
+    // Returns zero and takes a token from each rate limit of a binding if
+    // they allow it to fire now, otherwise how long until they will
+    std::chrono::steady_clock::duration throttle(int key, const Binding &binding,
+						 const std::map<std::string, double> &prefix_rates,
+						 std::chrono::steady_clock::time_point now);
+
+    // Dispatches the deferred presses the rate limits now allow.
+    // Returns how long until the next one may be
+    std::chrono::steady_clock::duration flush_deferred();
+
+    // Starts a hold on the first press and refreshes its watchdog on repeats
+    void press_hold(int key, const Binding &binding, std::chrono::steady_clock::time_point pressed);
+
+    // Ends a hold when its key is released
+    void release_hold(int key, std::chrono::steady_clock::time_point released);
+
+    // Ends every hold whose watchdog ran out.
+    // Returns how long until the next watchdog runs out
+    std::chrono::steady_clock::duration release_holds();
+
+    const BindingTable &bindings_;
+    PutScheduler &scheduler_;
+    LatencyStats &latency_;
+    StatusLine &status_;
+    UndoStack *const undo_;
+
+    SpscRing<KeyEvent, queue_capacity> ring_;
+    std::atomic<size_t> dropped_{0};
+    DeviceGenerations generations_;
+    std::map<int, Hold> holds_; // only used by the dispatch thread
+    std::map<int, TokenBucket> binding_buckets_; // by key, dispatch thread only
+    std::map<std::string, TokenBucket> prefix_buckets_; // by IOC prefix, dispatch thread only
+    std::map<int, Deferred> deferred_; // by key, dispatch thread only
+    std::atomic<size_t> throttled_{0};
+
+    // The dispatch thread sleeps on cv_ when the ring is empty. The input
+    // thread only touches the mutex when the dispatch thread is asleep
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> sleeping_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include "filewatch.h"
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+FileWatcher::FileWatcher(const std::vector<std::string> &paths) {
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) {
+	return;
+    }
+
+    // Watching a directory twice returns the same descriptor
+    for (const auto &path : paths) {
+	const size_t slash = path.rfind('/');
+	const std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+	const int wd = inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	if (wd < 0) {
+	    close(fd_);
+	    fd_ = -1;
+	    return;
+	}
+	names_[wd].insert(slash == std::string::npos ? path : path.substr(slash + 1));
+    }
+}
+
+FileWatcher::~FileWatcher() {
+    if (fd_ >= 0) {
+	close(fd_);
+    }
+}
+
+bool FileWatcher::changed() {
+    if (fd_ < 0) {
+	return false;
+    }
+
+    bool changed = false;
+    alignas(inotify_event) char buf[4096];
+    ssize_t len;
+    while ((len = read(fd_, buf, sizeof(buf))) > 0) {
+	for (char *p = buf; p < buf + len;) {
+	    const inotify_event *evt = reinterpret_cast<const inotify_event *>(p);
+	    auto names = names_.find(evt->wd);
+	    if (evt->len > 0 and names != names_.end() and names->second.count(evt->name) > 0) {
+		changed = true;
+	    }
+	    p += sizeof(inotify_event) + evt->len;
+	}
+    }
+    return changed;
+}
+
+#else
+
+FileWatcher::FileWatcher(const std::vector<std::string> &) {}
+
+FileWatcher::~FileWatcher() {}
+
+bool FileWatcher::changed() {
+    return false;
+}
+
+#endif
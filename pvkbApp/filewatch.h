@@ -0,0 +1,31 @@
+#ifndef PVKB_FILEWATCH_H
+#define PVKB_FILEWATCH_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Reports changes to a set of files, e.g. a config and the files it
+// includes, through inotify. The containing directories are watched rather
+// than the files, so editors which save by renaming a new file over the old
+// one are noticed too. Where inotify is not available changed() always
+// returns false.
+class FileWatcher {
+  public:
+    explicit FileWatcher(const std::vector<std::string> &paths);
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    // Returns true if any of the files was written or replaced since the last call.
+    // Never blocks
+    bool changed();
+
+  private:
+    int fd_ = -1;
+    std::map<int, std::set<std::string>> names_; // by watch descriptor
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef PVKB_KEYNAMES_H
+#define PVKB_KEYNAMES_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include <ncurses.h>
+
+// Key names used in the config file, e.g. key_a, key_f5, key_pagedown or
+// key_ctrl_alt_x, and the key codes the input backends report for them.
+// The name table is hashed at compile time into a collision free
+// (perfect) hash, so resolving a name is one hash and one compare.
+
+// Modifier bits or'ed into a key code for combinations which have no code
+// of their own, e.g. alt+x or ctrl+left. They are above every ncurses code
+constexpr int key_mod_shift = 1 << 16;
+constexpr int key_mod_alt = 1 << 17;
+constexpr int key_mod_ctrl = 1 << 18;
+
+// Modifiers as terminals encode them in escape sequences, minus one,
+// e.g. "\e[1;5A" is ctrl+up
+constexpr int modifier_shift = 1;
+constexpr int modifier_alt = 2;
+constexpr int modifier_ctrl = 4;
+
+// Returns the key code a terminal reports for a key pressed with modifiers.
+// Shift gives the upper case letter or the shifted ncurses code where one
+// exists, ctrl of a letter gives the control character, and everything
+// else gets the matching key_mod_* bit
+constexpr int apply_modifiers(int key, int modifiers) {
+    if (modifiers & modifier_shift) {
+	if (key >= 'a' and key <= 'z') {
+	    key -= 'a' - 'A';
+	} else {
+	    switch (key) {
+	    case KEY_LEFT: key = KEY_SLEFT; break;
+	    case KEY_RIGHT: key = KEY_SRIGHT; break;
+	    case KEY_UP: key = KEY_SR; break;
+	    case KEY_DOWN: key = KEY_SF; break;
+	    case KEY_HOME: key = KEY_SHOME; break;
+	    case KEY_END: key = KEY_SEND; break;
+	    case KEY_IC: key = KEY_SIC; break;
+	    case KEY_DC: key = KEY_SDC; break;
+	    case KEY_PPAGE: key = KEY_SPREVIOUS; break;
+	    case KEY_NPAGE: key = KEY_SNEXT; break;
+	    case '\t': key = KEY_BTAB; break;
+	    default: key |= key_mod_shift; break;
+	    }
+	}
+    }
+    if (modifiers & modifier_ctrl) {
+	if ((key >= 'a' and key <= 'z') or (key >= '@' and key <= '_')) {
+	    key &= 0x1f;
+	} else {
+	    key |= key_mod_ctrl;
+	}
+    }
+    if (modifiers & modifier_alt) {
+	key |= key_mod_alt;
+    }
+    return key;
+}
+
+struct KeyName {
+    std::string_view name;
+    int code = 0;
+};
+
+namespace keynames_detail {
+
+constexpr KeyName named_keys[] = {
+    // Names the terminal keys go by
+    {"enter", '\n'}, {"space", ' '}, {"tab", '\t'}, {"escape", 27}, {"pageup", KEY_PPAGE},
+    {"pagedown", KEY_NPAGE}, {"insert", KEY_IC}, {"delete", KEY_DC},
+
+    // Every ncurses KEY_* code, named after the macro
+    {"break", KEY_BREAK}, {"sreset", KEY_SRESET}, {"reset", KEY_RESET}, {"down", KEY_DOWN}, {"up", KEY_UP},
+    {"left", KEY_LEFT}, {"right", KEY_RIGHT}, {"home", KEY_HOME}, {"backspace", KEY_BACKSPACE}, {"dl", KEY_DL},
+    {"il", KEY_IL}, {"dc", KEY_DC}, {"ic", KEY_IC}, {"eic", KEY_EIC}, {"clear", KEY_CLEAR}, {"eos", KEY_EOS},
+    {"eol", KEY_EOL}, {"sf", KEY_SF}, {"sr", KEY_SR}, {"npage", KEY_NPAGE}, {"ppage", KEY_PPAGE},
+    {"stab", KEY_STAB}, {"ctab", KEY_CTAB}, {"catab", KEY_CATAB}, {"print", KEY_PRINT}, {"ll", KEY_LL},
+    {"a1", KEY_A1}, {"a3", KEY_A3}, {"b2", KEY_B2}, {"c1", KEY_C1}, {"c3", KEY_C3}, {"btab", KEY_BTAB},
+    {"beg", KEY_BEG}, {"cancel", KEY_CANCEL}, {"close", KEY_CLOSE}, {"command", KEY_COMMAND},
+    {"copy", KEY_COPY}, {"create", KEY_CREATE}, {"end", KEY_END}, {"exit", KEY_EXIT}, {"find", KEY_FIND},
+    {"help", KEY_HELP}, {"mark", KEY_MARK}, {"message", KEY_MESSAGE}, {"move", KEY_MOVE}, {"next", KEY_NEXT},
+    {"open", KEY_OPEN}, {"options", KEY_OPTIONS}, {"previous", KEY_PREVIOUS}, {"redo", KEY_REDO},
+    {"reference", KEY_REFERENCE}, {"refresh", KEY_REFRESH}, {"replace", KEY_REPLACE}, {"restart", KEY_RESTART},
+    {"resume", KEY_RESUME}, {"save", KEY_SAVE}, {"sbeg", KEY_SBEG}, {"scancel", KEY_SCANCEL},
+    {"scommand", KEY_SCOMMAND}, {"scopy", KEY_SCOPY}, {"screate", KEY_SCREATE}, {"sdc", KEY_SDC},
+    {"sdl", KEY_SDL}, {"select", KEY_SELECT}, {"send", KEY_SEND}, {"seol", KEY_SEOL}, {"sexit", KEY_SEXIT},
+    {"sfind", KEY_SFIND}, {"shelp", KEY_SHELP}, {"shome", KEY_SHOME}, {"sic", KEY_SIC}, {"sleft", KEY_SLEFT},
+    {"smessage", KEY_SMESSAGE}, {"smove", KEY_SMOVE}, {"snext", KEY_SNEXT}, {"soptions", KEY_SOPTIONS},
+    {"sprevious", KEY_SPREVIOUS}, {"sprint", KEY_SPRINT}, {"sredo", KEY_SREDO}, {"sreplace", KEY_SREPLACE},
+    {"sright", KEY_SRIGHT}, {"srsume", KEY_SRSUME}, {"ssave", KEY_SSAVE}, {"ssuspend", KEY_SSUSPEND},
+    {"sundo", KEY_SUNDO}, {"suspend", KEY_SUSPEND}, {"undo", KEY_UNDO}, {"mouse", KEY_MOUSE},
+    {"resize", KEY_RESIZE}, {"kp_enter", KEY_ENTER}, {"f0", KEY_F(0)}, {"f1", KEY_F(1)}, {"f2", KEY_F(2)},
+    {"f3", KEY_F(3)}, {"f4", KEY_F(4)}, {"f5", KEY_F(5)}, {"f6", KEY_F(6)}, {"f7", KEY_F(7)}, {"f8", KEY_F(8)},
+    {"f9", KEY_F(9)}, {"f10", KEY_F(10)}, {"f11", KEY_F(11)}, {"f12", KEY_F(12)}, {"f13", KEY_F(13)},
+    {"f14", KEY_F(14)}, {"f15", KEY_F(15)}, {"f16", KEY_F(16)}, {"f17", KEY_F(17)}, {"f18", KEY_F(18)},
+    {"f19", KEY_F(19)}, {"f20", KEY_F(20)}, {"f21", KEY_F(21)}, {"f22", KEY_F(22)}, {"f23", KEY_F(23)},
+    {"f24", KEY_F(24)}, {"f25", KEY_F(25)}, {"f26", KEY_F(26)}, {"f27", KEY_F(27)}, {"f28", KEY_F(28)},
+    {"f29", KEY_F(29)}, {"f30", KEY_F(30)}, {"f31", KEY_F(31)}, {"f32", KEY_F(32)}, {"f33", KEY_F(33)},
+    {"f34", KEY_F(34)}, {"f35", KEY_F(35)}, {"f36", KEY_F(36)}, {"f37", KEY_F(37)}, {"f38", KEY_F(38)},
+    {"f39", KEY_F(39)}, {"f40", KEY_F(40)}, {"f41", KEY_F(41)}, {"f42", KEY_F(42)}, {"f43", KEY_F(43)},
+    {"f44", KEY_F(44)}, {"f45", KEY_F(45)}, {"f46", KEY_F(46)}, {"f47", KEY_F(47)}, {"f48", KEY_F(48)},
+    {"f49", KEY_F(49)}, {"f50", KEY_F(50)}, {"f51", KEY_F(51)}, {"f52", KEY_F(52)}, {"f53", KEY_F(53)},
+    {"f54", KEY_F(54)}, {"f55", KEY_F(55)}, {"f56", KEY_F(56)}, {"f57", KEY_F(57)}, {"f58", KEY_F(58)},
+    {"f59", KEY_F(59)}, {"f60", KEY_F(60)}, {"f61", KEY_F(61)}, {"f62", KEY_F(62)}, {"f63", KEY_F(63)},
+};
+constexpr size_t named_count = sizeof(named_keys) / sizeof(named_keys[0]);
+
+// Every printable ASCII character is its own name, e.g. key_a or "key_,"
+constexpr char printable[] = "!\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~";
+constexpr size_t printable_count = sizeof(printable) - 1;
+
+constexpr size_t key_count = named_count + printable_count;
+
+constexpr std::array<KeyName, key_count> make_table() {
+    std::array<KeyName, key_count> table{};
+    for (size_t i = 0; i < named_count; i++) {
+	table[i] = named_keys[i];
+    }
+    for (size_t i = 0; i < printable_count; i++) {
+	table[named_count + i] = KeyName{std::string_view(printable + i, 1), printable[i]};
+    }
+    return table;
+}
+
+constexpr uint32_t fnv1a(std::string_view str, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : str) {
+	hash ^= static_cast<unsigned char>(c);
+	hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Two level perfect hash (hash and displace). Names are split into buckets
+// by one hash, then each bucket, biggest first, gets the first seed for
+// which a second hash puts all of its names into free slots
+constexpr size_t hash_buckets = key_count / 2 + 1;
+constexpr size_t hash_slots = 512;
+static_assert(hash_slots >= 2 * key_count, "Too many key names for the hash table");
+
+struct PerfectHash {
+    std::array<uint32_t, hash_buckets> seeds{};
+    std::array<int16_t, hash_slots> index{};
+    bool complete = false;
+};
+
+constexpr size_t bucket_of(std::string_view name) {
+    return fnv1a(name, 0) % hash_buckets;
+}
+
+constexpr PerfectHash build_hash(const std::array<KeyName, key_count> &table) {
+    PerfectHash hash{};
+    for (auto &entry : hash.index) {
+	entry = -1;
+    }
+
+    // Sort the names by bucket: bucket b holds by_bucket[start[b]..start[b+1])
+    std::array<size_t, hash_buckets + 1> start{};
+    std::array<size_t, hash_buckets> filled{};
+    std::array<size_t, key_count> by_bucket{};
+    for (const auto &entry : table) {
+	start[bucket_of(entry.name) + 1]++;
+    }
+    size_t largest = 0;
+    for (size_t b = 0; b < hash_buckets; b++) {
+	largest = start[b + 1] > largest ? start[b + 1] : largest;
+	start[b + 1] += start[b];
+    }
+    for (size_t i = 0; i < key_count; i++) {
+	const size_t b = bucket_of(table[i].name);
+	by_bucket[start[b] + filled[b]++] = i;
+    }
+
+    for (size_t size = largest; size > 0; size--) {
+	for (size_t b = 0; b < hash_buckets; b++) {
+	    if (start[b + 1] - start[b] != size) {
+		continue;
+	    }
+	    bool placed = false;
+	    for (uint32_t seed = 1; seed < 100000 and not placed; seed++) {
+		size_t done = 0;
+		while (done < size) {
+		    const size_t i = by_bucket[start[b] + done];
+		    const size_t slot = fnv1a(table[i].name, seed) % hash_slots;
+		    if (hash.index[slot] != -1) {
+			break;
+		    }
+		    hash.index[slot] = static_cast<int16_t>(i);
+		    done++;
+		}
+		placed = done == size;
+		if (placed) {
+		    hash.seeds[b] = seed;
+		} else {
+		    // Undo the partial placement before trying the next seed
+		    for (size_t k = 0; k < done; k++) {
+			hash.index[fnv1a(table[by_bucket[start[b] + k]].name, seed) % hash_slots] = -1;
+		    }
+		}
+	    }
+	    if (not placed) {
+		return hash;
+	    }
+	}
+    }
+    hash.complete = true;
+    return hash;
+}
+
+constexpr std::array<KeyName, key_count> key_table = make_table();
+constexpr PerfectHash key_hash = build_hash(key_table);
+static_assert(key_hash.complete, "No perfect hash found for the key names");
+
+// Returns the code of a key name without modifiers, e.g. "f5"
+constexpr std::optional<int> find_key(std::string_view name) {
+    const size_t slot = fnv1a(name, key_hash.seeds[bucket_of(name)]) % hash_slots;
+    const int16_t i = key_hash.index[slot];
+    if (i < 0 or key_table[i].name != name) {
+	return std::nullopt;
+    }
+    return key_table[i].code;
+}
+
+} // namespace keynames_detail
+
+// Returns every key name, without modifiers
+constexpr const std::array<KeyName, keynames_detail::key_count> &key_names() {
+    return keynames_detail::key_table;
+}
+
+// Returns the key code of a name like "a", "up", "f5" or "pagedown",
+// optionally preceded by any of "ctrl_", "alt_" and "shift_" (or "ctrl-", ...),
+// e.g. "ctrl_alt_x", "shift_left" or "ctrl-x"
+constexpr std::optional<int> key_code(std::string_view name) {
+    int modifiers = 0;
+    while (true) {
+	if (name.size() > 5 and (name.substr(0, 5) == "ctrl_" or name.substr(0, 5) == "ctrl-")) {
+	    modifiers |= modifier_ctrl;
+	    name.remove_prefix(5);
+	} else if (name.size() > 4 and (name.substr(0, 4) == "alt_" or name.substr(0, 4) == "alt-")) {
+	    modifiers |= modifier_alt;
+	    name.remove_prefix(4);
+	} else if (name.size() > 6 and (name.substr(0, 6) == "shift_" or name.substr(0, 6) == "shift-")) {
+	    modifiers |= modifier_shift;
+	    name.remove_prefix(6);
+	} else {
+	    break;
+	}
+    }
+    const std::optional<int> code = keynames_detail::find_key(name);
+    if (not code) {
+	return std::nullopt;
+    }
+    // ctrl_@ is NUL, which no key can be bound to: code 0 stands for the put list in logs and metrics
+    const int key = apply_modifiers(*code, modifiers);
+    if (key == 0) {
+	return std::nullopt;
+    }
+    return key;
+}
+
+// Checks at compile time that every name in the table resolves to its own code
+constexpr bool key_names_resolve() {
+    for (const auto &entry : key_names()) {
+	if (key_code(entry.name) != entry.code) {
+	    return false;
+	}
+    }
+    return true;
+}
+static_assert(key_names_resolve(), "Key name table is inconsistent");
+static_assert(key_code("ctrl_a") == 1 and key_code("shift_left") == KEY_SLEFT
+	      and key_code("alt_x") == ('x' | key_mod_alt) and key_code("ctrl-x") == 0x18 and not key_code("ctrl_")
+	      and not key_code("ctrl_@"),
+	      "Key modifiers are not applied");
+
+#endif
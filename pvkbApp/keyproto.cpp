@@ -0,0 +1,270 @@
+#include <cstdio>
+#include <sstream>
+#include <vector>
+
+#include <ncurses.h>
+#include <term.h>
+
+#include "keynames.h"
+#include "keyproto.h"
+
+namespace {
+
+// Report all keys as escape codes, with event types and shifted keys:
+// disambiguate (1) | event types (2) | alternate keys (4) | all keys (8)
+constexpr int kitty_flags = 1 | 2 | 4 | 8;
+
+// Returns the key of a "\e[N~" sequence, or 0 if there is none
+int tilde_key(int number) {
+    switch (number) {
+    case 2: return KEY_IC;
+    case 3: return KEY_DC;
+    case 5: return KEY_PPAGE;
+    case 6: return KEY_NPAGE;
+    case 7: return KEY_HOME;
+    case 8: return KEY_END;
+    case 11: return KEY_F(1);
+    case 12: return KEY_F(2);
+    case 13: return KEY_F(3);
+    case 14: return KEY_F(4);
+    case 15: return KEY_F(5);
+    case 17: return KEY_F(6);
+    case 18: return KEY_F(7);
+    case 19: return KEY_F(8);
+    case 20: return KEY_F(9);
+    case 21: return KEY_F(10);
+    case 23: return KEY_F(11);
+    case 24: return KEY_F(12);
+    default: return 0;
+    }
+}
+
+// Returns the key of one of the codes the protocol gives keys without a
+// character, from the Unicode private use area, or 0 if there is none.
+// Keypad keys give what they type in legacy mode. Media, lock and lone
+// modifier keys have no ncurses code
+int functional_key(int code) {
+    // F13 to F35
+    if (code >= 57376 and code <= 57398) {
+	return KEY_F(13 + code - 57376);
+    }
+    // keypad 0 to 9
+    if (code >= 57399 and code <= 57408) {
+	return '0' + code - 57399;
+    }
+    switch (code) {
+    case 57361: return KEY_PRINT;
+    case 57362: return KEY_BREAK;
+    case 57409: return '.';
+    case 57410: return '/';
+    case 57411: return '*';
+    case 57412: return '-';
+    case 57413: return '+';
+    case 57414: return KEY_ENTER;
+    case 57415: return '=';
+    case 57416: return ',';
+    case 57417: return KEY_LEFT;
+    case 57418: return KEY_RIGHT;
+    case 57419: return KEY_UP;
+    case 57420: return KEY_DOWN;
+    case 57421: return KEY_PPAGE;
+    case 57422: return KEY_NPAGE;
+    case 57423: return KEY_HOME;
+    case 57424: return KEY_END;
+    case 57425: return KEY_IC;
+    case 57426: return KEY_DC;
+    case 57427: return KEY_B2;
+    default: return 0;
+    }
+}
+
+// Returns the key of a "\e[N u" sequence, translated to what getch()
+// returns in legacy mode, or 0 for keys which have no binding
+int unicode_key(int code, int shifted, int modifiers) {
+    if (code == 13) {
+	return '\n';
+    } else if (code == 127) {
+	return KEY_BACKSPACE;
+    } else if ((modifiers & modifier_shift) and shifted > 0 and shifted < 0x80) {
+	return shifted;
+    } else if (code < 0x80) {
+	return code;
+    }
+    return functional_key(code);
+}
+
+// Returns the colon separated numbers of one parameter, e.g. "97:65" -> {97, 65}
+std::vector<int> split_param(const std::string &param) {
+    std::vector<int> values;
+    std::stringstream ss(param);
+    std::string item;
+    while (std::getline(ss, item, ':')) {
+	values.push_back(item.empty() ? 0 : std::stoi(item));
+    }
+    return values;
+}
+
+void write_terminal(const char *seq) {
+    std::fputs(seq, stdout);
+    std::fflush(stdout);
+}
+
+} // namespace
+
+bool enable_kitty_keyboard() {
+    // A terminal with the protocol answers the flags query before the
+    // primary device attributes query, which every terminal answers
+    keypad(stdscr, FALSE);
+    write_terminal("\x1b[?u\x1b[c");
+
+    std::string reply;
+    bool supported = false;
+    timeout(500);
+    for (int ch = getch(); ch != ERR; ch = getch()) {
+	reply += static_cast<char>(ch);
+	if (ch == 'u' and reply.find("\x1b[?") != std::string::npos) {
+	    supported = true;
+	} else if (ch == 'c') {
+	    break;
+	}
+    }
+
+    if (not supported) {
+	keypad(stdscr, TRUE);
+	return false;
+    }
+    char seq[16];
+    std::snprintf(seq, sizeof(seq), "\x1b[>%du", kitty_flags);
+    write_terminal(seq);
+    return true;
+}
+
+void disable_kitty_keyboard() {
+    write_terminal("\x1b[<u");
+}
+
+NcursesKeys::NcursesKeys() {
+    // xterm style capabilities of modified keys, e.g. kUP5 is ctrl+up.
+    // The number is the escape sequence modifier parameter
+    static const std::pair<const char *, int> capabilities[] = {
+	{"kUP", KEY_UP}, {"kDN", KEY_DOWN}, {"kLFT", KEY_LEFT}, {"kRIT", KEY_RIGHT}, {"kHOM", KEY_HOME},
+	{"kEND", KEY_END}, {"kIC", KEY_IC}, {"kDC", KEY_DC}, {"kPRV", KEY_PPAGE}, {"kNXT", KEY_NPAGE},
+    };
+    for (const auto &[capability, key] : capabilities) {
+	for (int parameter = 2; parameter <= 8; parameter++) {
+	    const std::string name = capability + std::to_string(parameter);
+	    const char *seq = tigetstr(const_cast<char *>(name.c_str()));
+	    if (seq == nullptr or seq == reinterpret_cast<char *>(-1)) {
+		continue;
+	    }
+	    if (const int code = key_defined(seq); code > 0) {
+		modified_[code] = apply_modifiers(key, parameter - 1);
+	    }
+	}
+    }
+}
+
+int NcursesKeys::translate(int ch, int timeout_ms) {
+    if (auto it = modified_.find(ch); it != modified_.end()) {
+	return it->second;
+    }
+    if (ch != 0x1b) {
+	return ch;
+    }
+
+    // ncurses already waited ESCDELAY for a sequence, so a key which is
+    // waiting right now was typed together with escape
+    timeout(0);
+    const int next = getch();
+    timeout(timeout_ms);
+    return next == ERR ? ch : apply_modifiers(translate(next, timeout_ms), modifier_alt);
+}
+
+std::optional<KeyInput> KittyDecoder::feed(int byte) {
+    if (pending_.empty()) {
+	if (byte != 0x1b) {
+	    return KeyInput{byte};
+	}
+	pending_ += static_cast<char>(byte);
+	return std::nullopt;
+    }
+
+    // Escape is sent as "\e[27u" in this mode, so an escape not followed
+    // by '[' is a legacy alt+key
+    if (pending_.size() == 1 and byte != '[') {
+	pending_.clear();
+	std::optional<KeyInput> input = feed(byte);
+	if (input) {
+	    input->key = apply_modifiers(input->key, modifier_alt);
+	}
+	return input;
+    }
+
+    pending_ += static_cast<char>(byte);
+    if (pending_.size() > 2 and byte >= 0x40 and byte <= 0x7e) {
+	const std::string seq = pending_;
+	pending_.clear();
+	return decode(seq);
+    }
+    if (pending_.size() > 32) {
+	pending_.clear(); // not a key sequence
+    }
+    return std::nullopt;
+}
+
+std::optional<KeyInput> KittyDecoder::decode(const std::string &seq) const {
+    // ESC [ params final, params are e.g. "97:65;2:1"
+    const char final_byte = seq.back();
+    const std::string params = seq.substr(2, seq.size() - 3);
+    if (not params.empty() and (params[0] < '0' or params[0] > '9')) {
+	return std::nullopt; // private replies like "?15u"
+    }
+
+    std::vector<std::vector<int>> fields;
+    std::stringstream ss(params);
+    std::string param;
+    try {
+	while (std::getline(ss, param, ';')) {
+	    fields.push_back(split_param(param));
+	}
+    } catch (const std::exception &) {
+	return std::nullopt;
+    }
+    const int code = fields.size() > 0 and fields[0].size() > 0 ? fields[0][0] : 1;
+    const int shifted = fields.size() > 0 and fields[0].size() > 1 ? fields[0][1] : 0;
+    int modifiers = fields.size() > 1 and fields[1].size() > 0 ? fields[1][0] - 1 : 0;
+    const int event = fields.size() > 1 and fields[1].size() > 1 ? fields[1][1] : 1;
+
+    KeyInput input{0};
+    if (event == 2) {
+	input.type = KeyEventType::repeat;
+    } else if (event == 3) {
+	input.type = KeyEventType::release;
+    }
+
+    int key = 0;
+    switch (final_byte) {
+    case 'A': key = KEY_UP; break;
+    case 'B': key = KEY_DOWN; break;
+    case 'C': key = KEY_RIGHT; break;
+    case 'D': key = KEY_LEFT; break;
+    case 'H': key = KEY_HOME; break;
+    case 'F': key = KEY_END; break;
+    case 'P': key = KEY_F(1); break;
+    case 'Q': key = KEY_F(2); break;
+    case 'S': key = KEY_F(4); break;
+    case '~': key = tilde_key(code); break;
+    case 'u': key = unicode_key(code, shifted, modifiers); break;
+    default: break;
+    }
+    if (key == 0) {
+	return std::nullopt;
+    }
+
+    // The shifted key already includes shift
+    if (final_byte == 'u' and (modifiers & modifier_shift) and key == shifted) {
+	modifiers &= ~modifier_shift;
+    }
+    input.key = apply_modifiers(key, modifiers & (modifier_shift | modifier_alt | modifier_ctrl));
+    return input;
+}
@@ -0,0 +1,59 @@
+#ifndef PVKB_KEYPROTO_H
+#define PVKB_KEYPROTO_H
+
+#include <map>
+#include <optional>
+#include <string>
+
+// Kind of key event. Legacy terminal input only ever reports presses,
+// auto-repeat looks the same as pressing the key again
+enum class KeyEventType { press, repeat, release };
+
+// A decoded key: an ncurses key code (e.g. 'a', '\n', KEY_UP) and what happened to it
+struct KeyInput {
+    int key;
+    KeyEventType type = KeyEventType::press;
+};
+
+// Asks the terminal whether it speaks the kitty progressive enhancement
+// keyboard protocol and if so turns on press/repeat/release reporting for
+// every key. Must be called after initscr(). Returns false, leaving the
+// terminal as it was, if the terminal did not answer
+bool enable_kitty_keyboard();
+
+// Restores the keyboard mode from before enable_kitty_keyboard()
+void disable_kitty_keyboard();
+
+// Translates getch() results to the codes of keynames.h. The codes ncurses
+// makes up for modified keys, such as ctrl+up, are looked up in terminfo,
+// and escape followed at once by another key is read as alt+key.
+// Must be constructed after initscr()
+class NcursesKeys {
+  public:
+    NcursesKeys();
+
+    // Returns the key for a getch() result. After an escape the next key is
+    // read, timeout_ms is the getch() timeout to restore afterwards
+    int translate(int ch, int timeout_ms);
+
+  private:
+    std::map<int, int> modified_;
+};
+
+// Decodes the escape sequences sent by a terminal in kitty keyboard mode,
+// e.g. "\e[97;1:3u" (a released) or "\e[1;1:2C" (right arrow repeated).
+// Bytes are fed one at a time as they are read, with ncurses keypad() off
+class KittyDecoder {
+  public:
+    // Returns the key event once the bytes fed so far form a complete key
+    std::optional<KeyInput> feed(int byte);
+
+  private:
+    // Returns the key event of a complete CSI sequence, or nullopt for
+    // sequences which are not keys (e.g. a late reply to a query)
+    std::optional<KeyInput> decode(const std::string &seq) const;
+
+    std::string pending_;
+};
+
+#endif
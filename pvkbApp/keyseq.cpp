@@ -0,0 +1,155 @@
+#include <map>
+#include <mutex>
+
+#include "keyseq.h"
+#include "keynames.h"
+
+// Codes given to sequences so far, by their keys. Shared by every trie so
+// a sequence read again on reload gets its old code back
+static std::mutex sequences_mutex;
+static std::map<std::string, int> sequence_codes;
+static std::map<int, std::string> sequence_labels;
+
+// Returns the code of the sequence typed as label, giving it a new one if
+// it has none yet
+static int sequence_code(const std::string &label) {
+    std::lock_guard<std::mutex> lock(sequences_mutex);
+    auto it = sequence_codes.find(label);
+    if (it != sequence_codes.end()) {
+	return it->second;
+    }
+    const int code = sequence_code_base + static_cast<int>(sequence_codes.size());
+    sequence_codes.emplace(label, code);
+    sequence_labels.emplace(code, label);
+    return code;
+}
+
+KeyTrie::KeyTrie() : nodes_(1) {}
+
+int KeyTrie::add(const std::vector<int> &keys, const std::vector<std::string> &names) {
+    State state = root;
+    for (size_t i = 0; i < keys.size(); i++) {
+	auto it = nodes_[state].next.find(keys[i]);
+	if (it != nodes_[state].next.end()) {
+	    state = it->second;
+	    continue;
+	}
+	const State child = static_cast<State>(nodes_.size());
+	Node node;
+	node.label = i == 0 ? names[i] : nodes_[state].label + " " + names[i];
+	nodes_.push_back(std::move(node));
+	nodes_[state].next.emplace(keys[i], child);
+	state = child;
+    }
+    if (not nodes_[state].code) {
+	nodes_[state].code = sequence_code(nodes_[state].label);
+    }
+    return *nodes_[state].code;
+}
+
+void KeyTrie::add_prefix_key(int key) {
+    if (auto state = step(root, key)) {
+	nodes_[*state].code = key;
+    }
+}
+
+std::optional<int> KeyTrie::find(const std::vector<int> &keys) const {
+    State state = root;
+    for (int key : keys) {
+	auto next = step(state, key);
+	if (not next) {
+	    return std::nullopt;
+	}
+	state = *next;
+    }
+    return nodes_[state].code;
+}
+
+std::optional<KeyTrie::State> KeyTrie::step(State state, int key) const {
+    auto it = nodes_[state].next.find(key);
+    if (it == nodes_[state].next.end()) {
+	return std::nullopt;
+    }
+    return it->second;
+}
+
+SequenceMatcher::SequenceMatcher(std::chrono::milliseconds timeout)
+    : timeout_(timeout), trie_(std::make_shared<const KeyTrie>()) {}
+
+void SequenceMatcher::reset(std::shared_ptr<const KeyTrie> trie) {
+    trie_ = std::move(trie);
+    state_ = KeyTrie::root;
+}
+
+std::vector<int> SequenceMatcher::feed(int key, std::chrono::steady_clock::time_point now) {
+    std::vector<int> fired;
+    auto next = trie_->step(state_, key);
+
+    // The key does not continue the partial sequence: fire what was typed
+    // so far if it is a binding of its own, then start over with this key
+    if (not next and state_ != KeyTrie::root) {
+	if (auto code = trie_->code(state_)) {
+	    fired.push_back(*code);
+	}
+	state_ = KeyTrie::root;
+	next = trie_->step(state_, key);
+    }
+
+    if (not next) {
+	fired.push_back(key);
+    } else if (trie_->has_next(*next)) {
+	state_ = *next;
+	deadline_ = now + timeout_;
+    } else {
+	fired.push_back(*trie_->code(*next));
+	state_ = KeyTrie::root;
+    }
+    return fired;
+}
+
+std::optional<int> SequenceMatcher::expire(std::chrono::steady_clock::time_point now) {
+    if (state_ == KeyTrie::root or now < deadline_) {
+	return std::nullopt;
+    }
+    const std::optional<int> code = trie_->code(state_);
+    state_ = KeyTrie::root;
+    return code;
+}
+
+std::optional<std::string> SequenceMatcher::partial() const {
+    if (state_ == KeyTrie::root) {
+	return std::nullopt;
+    }
+    return trie_->label(state_);
+}
+
+std::string key_label(int key) {
+    if (key == 0) {
+	return "(put list)";
+    } else if (key >= sequence_code_base) {
+	std::lock_guard<std::mutex> lock(sequences_mutex);
+	auto it = sequence_labels.find(key);
+	return it != sequence_labels.end() ? it->second : "(sequence " + std::to_string(key - sequence_code_base) + ")";
+    }
+
+    std::string modifiers;
+    if (key & key_mod_ctrl) {
+	modifiers += "ctrl_";
+    }
+    if (key & key_mod_alt) {
+	modifiers += "alt_";
+    }
+    if (key & key_mod_shift) {
+	modifiers += "shift_";
+    }
+    const int base = key & ~(key_mod_ctrl | key_mod_alt | key_mod_shift);
+    for (const auto &entry : key_names()) {
+	if (entry.code == base) {
+	    return modifiers + std::string(entry.name);
+	}
+    }
+    if (base >= 1 and base <= 26) {
+	return modifiers + "ctrl_" + static_cast<char>('a' + base - 1);
+    }
+    return modifiers + "#" + std::to_string(base);
+}
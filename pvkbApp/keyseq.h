@@ -0,0 +1,92 @@
+#ifndef PVKB_KEYSEQ_H
+#define PVKB_KEYSEQ_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Key sequence bindings such as "g m 1" or "ctrl-x r" are stored in a trie
+// with one node per typed prefix. Each sequence is given a code of its own,
+// above every key code, which is what the binding map is keyed by. A
+// sequence keeps its code for the life of the process, also across
+// reloads, so metrics and logs keyed by code never mix two sequences.
+constexpr int sequence_code_base = 1 << 20;
+
+// Returns the name of a binding code for logs and metrics, e.g. "ctrl_x"
+// or "f5", the keys of a sequence e.g. "g m 1", and "(put list)" for 0
+std::string key_label(int key);
+
+class KeyTrie {
+  public:
+    using State = uint32_t;
+    static constexpr State root = 0;
+
+    KeyTrie();
+
+    // Adds a sequence of two or more keys, named for display by names.
+    // Returns its code, the same code each time a sequence is added
+    int add(const std::vector<int> &keys, const std::vector<std::string> &names);
+
+    // Makes a single key binding fire when a sequence starting with the key
+    // is cut short, if any sequence starts with it
+    void add_prefix_key(int key);
+
+    // Returns the code of a sequence passed to add()
+    std::optional<int> find(const std::vector<int> &keys) const;
+
+    // Returns the state after typing key in state, or nullopt if no sequence continues with key
+    std::optional<State> step(State state, int key) const;
+
+    // Returns the binding which is complete in state, if any
+    std::optional<int> code(State state) const { return nodes_[state].code; }
+
+    // Returns true if a longer sequence continues from state
+    bool has_next(State state) const { return not nodes_[state].next.empty(); }
+
+    // Returns the keys typed to reach state, e.g. "ctrl-x"
+    const std::string &label(State state) const { return nodes_[state].label; }
+
+  private:
+    struct Node {
+	std::unordered_map<int, State> next;
+	std::optional<int> code;
+	std::string label;
+    };
+
+    std::vector<Node> nodes_;
+};
+
+// Advances through a KeyTrie one keypress at a time. A sequence fires as
+// soon as its last key is typed, unless a longer sequence continues from
+// it, in which case it fires when the next key does not continue it or
+// when no key arrives within the timeout.
+class SequenceMatcher {
+  public:
+    explicit SequenceMatcher(std::chrono::milliseconds timeout);
+
+    // Uses new sequences, any partially typed sequence is dropped
+    void reset(std::shared_ptr<const KeyTrie> trie);
+
+    // Advances by one keypress. Returns the codes of the bindings to fire:
+    // the key itself if it does not start a sequence, the code of a
+    // completed sequence, or nothing while a sequence is still being typed
+    std::vector<int> feed(int key, std::chrono::steady_clock::time_point now);
+
+    // Returns the binding of a partial sequence whose timeout ran out
+    std::optional<int> expire(std::chrono::steady_clock::time_point now);
+
+    // Returns the keys typed so far of a partial sequence, or nullopt if there is none
+    std::optional<std::string> partial() const;
+
+  private:
+    std::chrono::milliseconds timeout_;
+    std::shared_ptr<const KeyTrie> trie_;
+    KeyTrie::State state_ = KeyTrie::root;
+    std::chrono::steady_clock::time_point deadline_;
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include <array>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "keyseq.h"
+#include "metrics.h"
+
+namespace metrics {
+
+// Upper bounds of the put latency histogram buckets, in seconds
+static constexpr std::array<double, 10> latency_buckets = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0};
+
+struct BindingCounts {
+    uint64_t issued = 0;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    uint64_t throttled = 0;
+};
+
+static std::atomic<bool> enabled_{false};
+static std::atomic<int64_t> in_flight_{0};
+static std::array<std::atomic<uint64_t>, latency_buckets.size() + 1> latency_counts_{};
+static std::atomic<uint64_t> latency_sum_us_{0};
+static std::atomic<uint64_t> channel_connects_{0};
+static std::atomic<uint64_t> monitor_updates_{0};
+static std::atomic<uint64_t> monitor_disconnects_{0};
+static std::atomic<uint64_t> monitor_reconnects_{0};
+static std::atomic<uint64_t> input_events_{0};
+static std::mutex mutex_;
+static std::map<int, BindingCounts> bindings_;
+
+void enable() {
+    enabled_ = true;
+}
+
+bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+void put_issued(int key) {
+    if (not enabled()) {
+	return;
+    }
+    in_flight_.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    bindings_[key].issued++;
+}
+
+void put_completed(int key, bool ok, double seconds) {
+    if (not enabled()) {
+	return;
+    }
+    in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    size_t bucket = 0;
+    while (bucket < latency_buckets.size() and seconds > latency_buckets[bucket]) {
+	bucket++;
+    }
+    latency_counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+    latency_sum_us_.fetch_add(static_cast<uint64_t>(seconds * 1e6), std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    BindingCounts &counts = bindings_[key];
+    counts.completed++;
+    if (not ok) {
+	counts.failed++;
+    }
+}
+
+void put_abandoned() {
+    if (enabled()) {
+	in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void press_throttled(int key) {
+    if (not enabled()) {
+	return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    bindings_[key].throttled++;
+}
+
+void channel_connected() {
+    channel_connects_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void monitor_update() {
+    monitor_updates_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void monitor_disconnected() {
+    monitor_disconnects_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void monitor_reconnected() {
+    monitor_reconnects_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void input_events(size_t count) {
+    input_events_.fetch_add(count, std::memory_order_relaxed);
+}
+
+// Returns a key name quoted as a Prometheus label value
+static std::string label(int key) {
+    std::string quoted = "\"";
+    for (const char c : key_label(key)) {
+	if (c == '"' or c == '\\') {
+	    quoted += '\\';
+	}
+	quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Writes the HELP and TYPE lines of a metric
+static void header(std::ostream &out, const char *name, const char *type, const char *help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+std::string render() {
+    std::ostringstream out;
+    std::map<int, BindingCounts> bindings;
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	bindings = bindings_;
+    }
+
+    header(out, "pvkb_puts_issued_total", "counter", "Puts issued, by the key of their binding");
+    for (const auto &[key, counts] : bindings) {
+	out << "pvkb_puts_issued_total{key=" << label(key) << "} " << counts.issued << "\n";
+    }
+    header(out, "pvkb_puts_completed_total", "counter", "Puts completed, including failed ones, by binding key");
+    for (const auto &[key, counts] : bindings) {
+	out << "pvkb_puts_completed_total{key=" << label(key) << "} " << counts.completed << "\n";
+    }
+    header(out, "pvkb_puts_failed_total", "counter", "Puts which failed or timed out, by binding key");
+    for (const auto &[key, counts] : bindings) {
+	out << "pvkb_puts_failed_total{key=" << label(key) << "} " << counts.failed << "\n";
+    }
+    header(out, "pvkb_presses_throttled_total", "counter", "Presses dropped or coalesced by max_rate, by binding key");
+    for (const auto &[key, counts] : bindings) {
+	out << "pvkb_presses_throttled_total{key=" << label(key) << "} " << counts.throttled << "\n";
+    }
+    header(out, "pvkb_puts_in_flight", "gauge", "Puts issued and not yet completed");
+    out << "pvkb_puts_in_flight " << in_flight_.load(std::memory_order_relaxed) << "\n";
+
+    header(out, "pvkb_put_latency_seconds", "histogram", "Time from issuing a put until it completed");
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < latency_counts_.size(); i++) {
+	cumulative += latency_counts_[i].load(std::memory_order_relaxed);
+	out << "pvkb_put_latency_seconds_bucket{le=\"";
+	if (i < latency_buckets.size()) {
+	    out << latency_buckets[i];
+	} else {
+	    out << "+Inf";
+	}
+	out << "\"} " << cumulative << "\n";
+    }
+    out << "pvkb_put_latency_seconds_sum " << latency_sum_us_.load(std::memory_order_relaxed) / 1e6 << "\n";
+    out << "pvkb_put_latency_seconds_count " << cumulative << "\n";
+
+    header(out, "pvkb_channel_connects_total", "counter", "Channels connected");
+    out << "pvkb_channel_connects_total " << channel_connects_.load(std::memory_order_relaxed) << "\n";
+    header(out, "pvkb_monitor_updates_total", "counter", "Updates delivered by readback and waveform monitors");
+    out << "pvkb_monitor_updates_total " << monitor_updates_.load(std::memory_order_relaxed) << "\n";
+    header(out, "pvkb_monitor_disconnects_total", "counter", "Times a monitor lost its channel");
+    out << "pvkb_monitor_disconnects_total " << monitor_disconnects_.load(std::memory_order_relaxed) << "\n";
+    header(out, "pvkb_monitor_reconnects_total", "counter", "Times a monitor delivered data again after a disconnect");
+    out << "pvkb_monitor_reconnects_total " << monitor_reconnects_.load(std::memory_order_relaxed) << "\n";
+    header(out, "pvkb_input_events_total", "counter", "Key presses, repeats and releases read from the terminal");
+    out << "pvkb_input_events_total " << input_events_.load(std::memory_order_relaxed) << "\n";
+    return out.str();
+}
+
+}
+
+MetricsServer::MetricsServer(const std::string &address) {
+    if (address.rfind("unix:", 0) == 0) {
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	unix_path_ = address.substr(5);
+	if (unix_path_.empty() or unix_path_.length() >= sizeof(addr.sun_path)) {
+	    throw std::runtime_error("Invalid metrics socket path '" + unix_path_ + "'");
+	}
+	std::strcpy(addr.sun_path, unix_path_.c_str());
+	// A socket left behind by an earlier run would make bind() fail
+	unlink(unix_path_.c_str());
+	fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd_ < 0 or bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+	    const std::string error = std::strerror(errno);
+	    if (fd_ >= 0) {
+		close(fd_);
+	    }
+	    throw std::runtime_error("Cannot bind metrics socket " + unix_path_ + ": " + error);
+	}
+    } else {
+	const size_t colon = address.rfind(':');
+	const std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+	const std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	try {
+	    const int port_number = std::stoi(port);
+	    if (port_number <= 0 or port_number > 65535) {
+		throw std::out_of_range(port);
+	    }
+	    addr.sin_port = htons(static_cast<uint16_t>(port_number));
+	} catch (const std::exception &e) {
+	    throw std::runtime_error("Invalid metrics port '" + port + "'");
+	}
+	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+	    throw std::runtime_error("Invalid metrics address '" + host + "'");
+	}
+	fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	const int reuse = 1;
+	if (fd_ < 0 or setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0
+	    or bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+	    const std::string error = std::strerror(errno);
+	    if (fd_ >= 0) {
+		close(fd_);
+	    }
+	    throw std::runtime_error("Cannot bind metrics port " + address + ": " + error);
+	}
+    }
+    if (listen(fd_, 8) < 0) {
+	close(fd_);
+	throw std::runtime_error("Cannot listen for metrics on " + address);
+    }
+    metrics::enable();
+    thread_ = std::thread(&MetricsServer::run, this);
+}
+
+MetricsServer::~MetricsServer() {
+    stop_ = true;
+    thread_.join();
+    close(fd_);
+    if (not unix_path_.empty()) {
+	unlink(unix_path_.c_str());
+    }
+}
+
+void MetricsServer::run() {
+    while (not stop_) {
+	// Wake up now and then to notice stop_
+	pollfd listener{fd_, POLLIN, 0};
+	if (poll(&listener, 1, 200) <= 0) {
+	    continue;
+	}
+	const int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+	if (client < 0) {
+	    continue;
+	}
+
+	// Read the request header, giving a slow client a second at most.
+	// Every path serves the metrics
+	std::string request;
+	char buf[1024];
+	pollfd conn{client, POLLIN, 0};
+	while (request.find("\r\n\r\n") == std::string::npos and request.length() < 8192
+	       and poll(&conn, 1, 1000) > 0) {
+	    const ssize_t n = read(client, buf, sizeof(buf));
+	    if (n <= 0) {
+		break;
+	    }
+	    request.append(buf, static_cast<size_t>(n));
+	}
+
+	const std::string body = metrics::render();
+	const std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+	    + std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+	for (size_t sent = 0; sent < response.length();) {
+	    const ssize_t n = send(client, response.data() + sent, response.length() - sent, MSG_NOSIGNAL);
+	    if (n <= 0) {
+		break;
+	    }
+	    sent += static_cast<size_t>(n);
+	}
+	close(client);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef PVKB_METRICS_H
+#define PVKB_METRICS_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Counters of what pvkb is doing, exported in the Prometheus text format.
+// They are updated from the input thread, the dispatch thread and pvAccess
+// worker threads. Global counters are atomics, and per binding counters
+// take a short lock, which is only done once enable() was called
+namespace metrics {
+
+// Starts counting
+void enable();
+
+// Returns true if enable() was called
+bool enabled();
+
+// A put of the binding of key was issued
+void put_issued(int key);
+
+// A put of the binding of key completed after seconds, or failed
+void put_completed(int key, bool ok, double seconds);
+
+// A put which was issued was cancelled or destroyed without completing
+void put_abandoned();
+
+// A press of the binding of key was dropped or coalesced by its rate limit
+void press_throttled(int key);
+
+// A channel finished connecting
+void channel_connected();
+
+// A monitor delivered an update
+void monitor_update();
+
+// A monitor lost its channel
+void monitor_disconnected();
+
+// A monitor delivered data again after losing its channel
+void monitor_reconnected();
+
+// The input backend decoded count key events
+void input_events(size_t count);
+
+// Returns every metric in the Prometheus text exposition format
+std::string render();
+
+}
+
+// Serves the metrics to HTTP GET requests on a local TCP port, e.g.
+// "9100" or "127.0.0.1:9100", or on a Unix socket, e.g. "unix:/tmp/pvkb.sock".
+// A port alone binds to 127.0.0.1 only. Requests are answered one at a
+// time on a thread of its own
+class MetricsServer {
+  public:
+    // Starts listening. Throws if the address is invalid or cannot be bound
+    explicit MetricsServer(const std::string &address);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+  private:
+    void run();
+
+    int fd_ = -1;
+    std::string unix_path_;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef PVKB_MPSCRING_H
+#define PVKB_MPSCRING_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Fixed size lock-free ring buffer for any number of producer threads and
+// one consumer thread. Producers claim a slot by advancing head_ with a
+// compare and swap, and each slot carries a sequence number which tells
+// the consumer when the producer finished writing it, and tells producers
+// when the consumer finished reading it (Vyukov's bounded queue).
+// A full ring makes push() fail rather than wait.
+template <typename T, size_t Capacity>
+class MpscRing {
+    static_assert(Capacity > 0 and (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+  public:
+    MpscRing() {
+	for (size_t i = 0; i < Capacity; i++) {
+	    slots_[i].sequence.store(i, std::memory_order_relaxed);
+	}
+    }
+
+    MpscRing(const MpscRing &) = delete;
+    MpscRing &operator=(const MpscRing &) = delete;
+
+    // Producer: appends an item, returns false if the ring is full
+    bool push(const T &item) {
+	size_t head = head_.load(std::memory_order_relaxed);
+	while (true) {
+	    Slot &slot = slots_[head & (Capacity - 1)];
+	    const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+	    if (sequence == head) {
+		if (head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+		    slot.item = item;
+		    slot.sequence.store(head + 1, std::memory_order_release);
+		    return true;
+		}
+	    } else if (sequence < head) {
+		// The consumer has not read this slot yet since the last lap
+		return false;
+	    } else {
+		head = head_.load(std::memory_order_relaxed);
+	    }
+	}
+    }
+
+    // Consumer: moves up to max items into out, returns the number moved
+    size_t pop(T *out, size_t max) {
+	size_t n = 0;
+	while (n < max) {
+	    Slot &slot = slots_[tail_ & (Capacity - 1)];
+	    if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+		break;
+	    }
+	    out[n++] = slot.item;
+	    slot.sequence.store(tail_ + Capacity, std::memory_order_release);
+	    tail_++;
+	}
+	return n;
+    }
+
+    static constexpr size_t capacity() {
+	return Capacity;
+    }
+
+  private:
+    struct Slot {
+	std::atomic<size_t> sequence;
+	T item;
+    };
+
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) size_t tail_ = 0;
+    alignas(64) std::array<Slot, Capacity> slots_;
+};
+
+#endif
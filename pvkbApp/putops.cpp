@@ -0,0 +1,527 @@
+#include <algorithm>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+
+#include <pv/pvData.h>
+
+#include "putops.h"
+#include "trace.h"
+#include "auditlog.h"
+#include "metrics.h"
+
+bool is_array_type(const std::string &type_str) {
+    static constexpr std::string_view suffix = "[]";
+    return type_str.length() > suffix.length()
+	and type_str.compare(type_str.length() - suffix.length(), suffix.length(), suffix) == 0
+	and type_str != "string[]" and type_str != "boolean[]";
+}
+
+bool is_integer_type(const std::string &type_str) {
+    return type_str != "double" and type_str != "float" and type_str != "boolean" and type_str != "string"
+	and type_str != "enum_t" and not is_array_type(type_str);
+}
+
+// Written as a plain indexed loop over raw pointers so the compiler
+// vectorizes it (SSE2/AVX at -O3)
+void add_offset(const double *src, const double *offset, double *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+	dst[i] = src[i] + offset[i];
+    }
+}
+
+void add_offset(const double *src, double offset, double *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+	dst[i] = src[i] + offset;
+    }
+}
+
+epics::pvData::shared_vector<const double> increment_array(const epics::pvData::shared_vector<const double> &current,
+							   const TargetVar &val) {
+    epics::pvData::shared_vector<double> result(current.size());
+    if (auto offsets = std::get_if<std::vector<double>>(&val)) {
+	if (offsets->size() != current.size()) {
+	    throw std::runtime_error("Increment array length does not match PV array length");
+	}
+	add_offset(current.data(), offsets->data(), result.data(), current.size());
+    } else {
+	const double offset = std::holds_alternative<int>(val) ? std::get<int>(val) : std::get<double>(val);
+	add_offset(current.data(), offset, result.data(), current.size());
+    }
+    return epics::pvData::freeze(result);
+}
+
+PutBarrier::PutBarrier(Callback on_complete) : on_complete_(std::move(on_complete)) {}
+
+void PutBarrier::add(const std::string &pv_name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.insert(pv_name);
+}
+
+void PutBarrier::done(const std::string &pv_name, const pvac::PutEvent &evt) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = pending_.find(pv_name);
+    if (it == pending_.end()) {
+	return; // already counted, e.g. cancelled after a timeout
+    }
+    pending_.erase(it);
+
+    if (evt.event == pvac::PutEvent::Fail) {
+	errors_.push_back(pv_name + ": " + evt.message);
+    } else if (evt.event == pvac::PutEvent::Cancel) {
+	errors_.push_back(pv_name + ": cancelled");
+    }
+    check_complete(lock);
+}
+
+void PutBarrier::seal() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    sealed_ = true;
+    check_complete(lock);
+}
+
+void PutBarrier::check_complete(std::unique_lock<std::mutex> &lock) {
+    if (not sealed_ or not pending_.empty()) {
+	return;
+    }
+    cv_.notify_all();
+
+    if (on_complete_) {
+	Callback on_complete = std::move(on_complete_);
+	on_complete_ = nullptr;
+	const std::vector<std::string> errors = errors_;
+	lock.unlock();
+	on_complete(errors);
+    }
+}
+
+bool PutBarrier::wait(double timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, std::chrono::duration<double>(timeout),
+			[this] { return sealed_ and pending_.empty(); });
+}
+
+std::vector<std::string> PutBarrier::errors() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> errors = errors_;
+    for (const auto &pv_name : pending_) {
+	errors.push_back(pv_name + ": timeout");
+    }
+    return errors;
+}
+
+AsyncPut::AsyncPut(const PutAction &action, const BarrierList &barriers, Callback on_done)
+    : action_(action), barriers_(barriers), on_done_(std::move(on_done)), started_(std::chrono::steady_clock::now()) {}
+
+AsyncPut::~AsyncPut() {
+    // Make sure no callback can arrive once we are gone. A put cancelled
+    // in flight, e.g. superseded by an urgent put, never completes, so it
+    // leaves the in-flight count here
+    if (not finished_.exchange(true) and issued_) {
+	metrics::put_abandoned();
+    }
+    op_.cancel();
+}
+
+void AsyncPut::start() {
+    // An urgent put or the scheduler going away may have finished it already
+    if (finished_) {
+	return;
+    }
+
+    // The cached waveform holds the result of the previous put to the PV
+    // as soon as it completed, see complete(), so increments chain even
+    // when the monitor update lags behind the puts
+    if (action_.increment and action_.cache) {
+	cached_ = action_.cache->array();
+    }
+    const bool get_previous = action_.increment and not cached_;
+
+    metrics::put_issued(action_.key);
+    op_ = action_.channel.put(this, epics::pvData::PVStructure::const_shared_pointer(), get_previous);
+    issued_ = true;
+}
+
+void AsyncPut::expire() {
+    // A put not issued yet is still being started on another thread,
+    // which owns op_ until then
+    if (finished_ or not issued_) {
+	return;
+    }
+    op_.cancel();
+
+    pvac::PutEvent evt;
+    evt.event = pvac::PutEvent::Fail;
+    evt.message = "timeout";
+    complete(evt);
+}
+
+double AsyncPut::age() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count();
+}
+// Stores val in the given field of a put structure
+static void assign_value(epics::pvData::PVField &field, const TargetVar &val) {
+    std::visit([&](auto &&arg) {
+	using T = std::decay_t<decltype(arg)>;
+	if constexpr (std::is_same_v<T, std::vector<double>>) {
+	    epics::pvData::shared_vector<double> data(arg.size());
+	    std::copy(arg.begin(), arg.end(), data.begin());
+	    dynamic_cast<epics::pvData::PVScalarArray &>(field).putFrom<double>(epics::pvData::freeze(data));
+	} else if constexpr (std::is_same_v<T, bool>) {
+	    dynamic_cast<epics::pvData::PVBoolean &>(field).put(arg);
+	} else {
+	    dynamic_cast<epics::pvData::PVScalar &>(field).putFrom<T>(arg);
+	}
+    }, val);
+}
+
+void AsyncPut::putBuild(const epics::pvData::StructureConstPtr &build, Args &args) {
+    epics::pvData::PVStructurePtr root(epics::pvData::getPVDataCreate()->createPVStructure(build));
+
+    const std::string target_field = action_.pv_type == "enum_t" ? "value.index" : "value";
+    epics::pvData::PVFieldPtr field = root->getSubFieldT(target_field);
+
+    if (is_array_type(action_.pv_type) and action_.increment) {
+	// whole waveform is sent as a single put
+	epics::pvData::shared_vector<const double> current;
+	if (cached_) {
+	    current = *cached_;
+	} else {
+	    args.previous->getSubFieldT<epics::pvData::PVScalarArray>("value")->getAs<double>(current);
+	}
+	sent_array_ = increment_array(current, action_.value);
+	dynamic_cast<epics::pvData::PVScalarArray &>(*field).putFrom<double>(*sent_array_);
+    } else if (action_.increment) {
+	auto current = args.previous->getSubFieldT<epics::pvData::PVScalar>("value");
+	// The IOC would reject or clamp a value past its limits without telling anyone
+	if (auto inc_val = std::get_if<int>(&action_.value)) {
+	    const int result = static_cast<int>(clamp_to_limits(action_, current->getAs<int>() + *inc_val));
+	    assign_value(*field, result);
+	    sent_ = result;
+	} else {
+	    const double result = clamp_to_limits(action_, current->getAs<double>() + std::get<double>(action_.value));
+	    assign_value(*field, result);
+	    sent_ = result;
+	}
+    } else {
+	assign_value(*field, action_.value);
+    }
+
+    if (args.previous) {
+	// The put fetched the current value for the increment first
+	tracing::span("get", action_.pv_name, started_);
+    }
+    args.tosend.set(field->getFieldOffset());
+    args.root = root;
+}
+
+void AsyncPut::putDone(const pvac::PutEvent &evt) {
+    complete(evt);
+}
+
+void AsyncPut::complete(const pvac::PutEvent &evt) {
+    if (finished_.exchange(true)) {
+	return;
+    }
+    tracing::span("put", action_.pv_name, started_);
+    if (sent_array_ and action_.cache and evt.event == pvac::PutEvent::Success) {
+	action_.cache->store_array(*sent_array_);
+    }
+    metrics::put_completed(action_.key, evt.event == pvac::PutEvent::Success, age());
+    AuditLog::with_installed([&](AuditLog &log) {
+	log.record(make_audit_record(action_, sent_, evt.event == pvac::PutEvent::Success, started_));
+    });
+    for (const auto &barrier : barriers_) {
+	barrier->done(action_.pv_name, evt);
+    }
+    if (on_done_) {
+	on_done_(this);
+    }
+}
+
+// Returns the low and high limit of an action, or nullopt if there are none in force
+static std::optional<std::pair<double, double>> limit_range(const PutAction &action) {
+    if (not action.limits) {
+	return std::nullopt;
+    }
+    const std::optional<double> high = action.limits->high->number();
+    const std::optional<double> low = action.limits->low->number();
+    if (not high or not low or *high <= *low) {
+	return std::nullopt;
+    }
+    return std::make_pair(*low, *high);
+}
+
+double clamp_to_limits(const PutAction &action, double value) {
+    if (auto range = limit_range(action)) {
+	return std::clamp(value, range->first, range->second);
+    }
+    return value;
+}
+
+std::optional<double> pinned_limit(const PutAction &action) {
+    const std::optional<std::pair<double, double>> range = limit_range(action);
+    const std::optional<double> current = action.cache ? action.cache->number() : std::nullopt;
+    if (not action.increment or not range or not current) {
+	return std::nullopt;
+    }
+    const double step = std::holds_alternative<int>(action.value) ? std::get<int>(action.value)
+	: std::holds_alternative<double>(action.value) ? std::get<double>(action.value) : 0.0;
+    if (step > 0.0 and *current >= range->second) {
+	return range->second;
+    } else if (step < 0.0 and *current <= range->first) {
+	return range->first;
+    }
+    return std::nullopt;
+}
+
+std::string device_of(const std::string &pv_name) {
+    return pv_name.substr(0, pv_name.rfind('.'));
+}
+
+// Adds the increment inc onto a queued value, returns false if they can't be combined
+static bool accumulate(TargetVar &queued, const TargetVar &inc) {
+    const double *inc_num = std::get_if<double>(&inc);
+    const double inc_val = inc_num ? *inc_num : std::holds_alternative<int>(inc) ? std::get<int>(inc) : 0.0;
+    const bool inc_scalar = inc_num or std::holds_alternative<int>(inc);
+
+    if (auto arr = std::get_if<std::vector<double>>(&queued)) {
+	if (auto offsets = std::get_if<std::vector<double>>(&inc)) {
+	    if (offsets->size() != arr->size()) {
+		return false;
+	    }
+	    add_offset(arr->data(), offsets->data(), arr->data(), arr->size());
+	} else if (inc_scalar) {
+	    add_offset(arr->data(), inc_val, arr->data(), arr->size());
+	} else {
+	    return false;
+	}
+    } else if (std::holds_alternative<int>(queued) and std::holds_alternative<int>(inc)) {
+	std::get<int>(queued) += std::get<int>(inc);
+    } else if (std::holds_alternative<int>(queued) and inc_scalar) {
+	queued = std::get<int>(queued) + inc_val;
+    } else if (std::holds_alternative<double>(queued) and inc_scalar) {
+	std::get<double>(queued) += inc_val;
+    } else {
+	return false;
+    }
+    return true;
+}
+
+PutScheduler::~PutScheduler() {
+    std::map<std::string, Slot> slots;
+    std::vector<std::shared_ptr<AsyncPut>> urgent;
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	slots.swap(slots_);
+	urgent.swap(urgent_);
+    }
+    // AsyncPut destructors cancel whatever is still in flight
+}
+
+void PutScheduler::submit(const PutAction &action, const std::shared_ptr<PutBarrier> &barrier) {
+    reap();
+    barrier->add(action.pv_name);
+
+    std::deque<Pending> superseded;
+    std::shared_ptr<AsyncPut> put;
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	Slot &slot = slots_[action.pv_name];
+
+	if (not slot.in_flight) {
+	    put = std::make_shared<AsyncPut>(action, BarrierList{barrier}, [this](AsyncPut *p) { put_done(p); });
+	    slot.in_flight = put;
+	} else if (not action.increment) {
+	    // an absolute value makes everything queued before it irrelevant
+	    superseded.swap(slot.queue);
+	    slot.queue.push_back({action, {barrier}});
+	} else if (not slot.queue.empty() and accumulate(slot.queue.back().action.value, action.value)) {
+	    slot.queue.back().barriers.push_back(barrier);
+	} else {
+	    slot.queue.push_back({action, {barrier}});
+	}
+    }
+
+    // Superseded puts count as done, their value would have been overwritten anyway
+    pvac::PutEvent success;
+    success.event = pvac::PutEvent::Success;
+    for (const auto &pending : superseded) {
+	for (const auto &b : pending.barriers) {
+	    b->done(pending.action.pv_name, success);
+	}
+    }
+    if (put) {
+	put->start();
+    }
+}
+
+void PutScheduler::submit_urgent(const PutAction &action, const std::shared_ptr<PutBarrier> &barrier) {
+    barrier->add(action.pv_name);
+
+    std::vector<Pending> cancelled;
+    auto put = std::make_shared<AsyncPut>(action, BarrierList{barrier}, [this](AsyncPut *p) { put_done(p); });
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	const std::string device = device_of(action.pv_name);
+	for (auto &[pv_name, slot] : slots_) {
+	    if (device_of(pv_name) == device) {
+		std::move(slot.queue.begin(), slot.queue.end(), std::back_inserter(cancelled));
+		slot.queue.clear();
+	    }
+	}
+	urgent_.push_back(put);
+    }
+
+    // Issue the urgent put before doing anything else
+    put->start();
+
+    pvac::PutEvent cancel;
+    cancel.event = pvac::PutEvent::Cancel;
+    for (const auto &pending : cancelled) {
+	for (const auto &b : pending.barriers) {
+	    b->done(pending.action.pv_name, cancel);
+	}
+    }
+    reap();
+}
+
+void PutScheduler::put_done(AsyncPut *put) {
+    std::shared_ptr<AsyncPut> next;
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto urgent_it = std::find_if(urgent_.begin(), urgent_.end(),
+				      [put](const auto &p) { return p.get() == put; });
+	if (urgent_it != urgent_.end()) {
+	    retired_.push_back(std::move(*urgent_it));
+	    urgent_.erase(urgent_it);
+	    return;
+	}
+
+	auto slot_it = slots_.find(put->action().pv_name);
+	if (slot_it == slots_.end() or slot_it->second.in_flight.get() != put) {
+	    return;
+	}
+	Slot &slot = slot_it->second;
+	retired_.push_back(std::move(slot.in_flight));
+
+	if (not slot.queue.empty()) {
+	    Pending pending = std::move(slot.queue.front());
+	    slot.queue.pop_front();
+	    next = std::make_shared<AsyncPut>(pending.action, pending.barriers,
+					      [this](AsyncPut *p) { put_done(p); });
+	    slot.in_flight = next;
+	}
+    }
+    // started outside the lock since a put may complete synchronously
+    if (next) {
+	next->start();
+    }
+}
+
+void PutScheduler::expire(double timeout) {
+    reap();
+
+    std::vector<std::shared_ptr<AsyncPut>> expired;
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (const auto &[pv_name, slot] : slots_) {
+	    if (slot.in_flight and slot.in_flight->issued() and slot.in_flight->age() > timeout) {
+		expired.push_back(slot.in_flight);
+	    }
+	}
+	for (const auto &put : urgent_) {
+	    if (put->issued() and put->age() > timeout) {
+		expired.push_back(put);
+	    }
+	}
+    }
+    for (const auto &put : expired) {
+	put->expire();
+    }
+}
+
+void PutScheduler::reap() {
+    std::vector<std::shared_ptr<AsyncPut>> retired;
+    {
+	std::lock_guard<std::mutex> lock(mutex_);
+	retired.swap(retired_);
+    }
+}
+
+void LatencyStats::record(double seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    min_ = count_ == 0 ? seconds : std::min(min_, seconds);
+    max_ = count_ == 0 ? seconds : std::max(max_, seconds);
+    total_ += seconds;
+    count_++;
+}
+
+std::string LatencyStats::summary() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count_ == 0) {
+	return "n=0";
+    }
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1)
+       << "n=" << count_
+       << " min=" << min_ * 1e3 << "ms"
+       << " mean=" << total_ / count_ * 1e3 << "ms"
+       << " max=" << max_ * 1e3 << "ms";
+    return ss.str();
+}
+
+std::vector<std::string> execute_puts(const std::vector<PutAction> &actions, double timeout, size_t window) {
+    auto barrier = std::make_shared<PutBarrier>();
+
+    // Each completed put starts the next one, so window puts stay in flight.
+    // The next put is claimed under the lock but started outside it, since a
+    // put may complete synchronously and re-enter. starting counts the puts
+    // being started, which must finish before puts is destroyed.
+    // Declared before puts, which must be destroyed first
+    std::mutex mutex;
+    std::condition_variable started;
+    size_t next = 0;
+    size_t starting = 0;
+    bool stopped = false;
+    std::vector<std::unique_ptr<AsyncPut>> puts;
+    auto start_next = [&](AsyncPut *) {
+	AsyncPut *put = nullptr;
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    if (stopped or next == puts.size()) {
+		return;
+	    }
+	    put = puts[next++].get();
+	    starting++;
+	}
+	put->start();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (--starting == 0) {
+	    started.notify_all();
+	}
+    };
+
+    puts.reserve(actions.size());
+    for (const auto &action : actions) {
+	barrier->add(action.pv_name);
+	puts.push_back(std::make_unique<AsyncPut>(action, BarrierList{barrier}, start_next));
+    }
+    barrier->seal();
+    const size_t initial = window == 0 ? puts.size() : std::min(window, puts.size());
+    for (size_t i = 0; i < initial; i++) {
+	start_next(nullptr);
+    }
+    barrier->wait(timeout);
+    {
+	std::unique_lock<std::mutex> lock(mutex);
+	stopped = true;
+	started.wait(lock, [&] { return starting == 0; });
+    }
+
+    // Anything still outstanding is cancelled when puts goes out of scope
+    return barrier->errors();
+}
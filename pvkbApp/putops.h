@@ -0,0 +1,230 @@
+#ifndef PVKB_PUTOPS_H
+#define PVKB_PUTOPS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <pva/client.h>
+
+#include "pvcache.h"
+
+// Stores the value field of keybinding with the appropriate type
+// e.g. key_right = {pv="m1.TWF", value=1} or {pv="traj", value=[0.0, 0.5, 1.0]}
+using TargetVar = std::variant<int, double, bool, std::string, std::vector<double>>;
+
+// Monitored limit fields of a PV, e.g. m1.DRVH and m1.DRVL
+struct PutLimits {
+    std::shared_ptr<PVCache> high;
+    std::shared_ptr<PVCache> low;
+    std::string high_pv; // names of the limit PVs, which must stay connected
+    std::string low_pv;
+};
+
+// A single put: PVA channel, PV type name, target value, increment flag,
+// and whether it belongs to the urgent priority lane.
+// Array increments also keep a monitor cache of the waveform.
+struct PutAction {
+    pvac::ClientChannel channel;
+    std::string pv_name;
+    std::string pv_type;
+    TargetVar value;
+    bool increment = false;
+    bool urgent = false;
+    std::shared_ptr<PVCache> cache;
+    int key = 0; // key code of the binding, for the audit log
+    std::shared_ptr<const PutLimits> limits; // scalar increments are clamped to these
+};
+
+// Returns value clamped to the limits of an action. Unchanged if it has
+// none, they have no value yet, or they are unset (high <= low, as EPICS treats them)
+double clamp_to_limits(const PutAction &action, double value);
+
+// Returns the limit an increment moves towards, if the PV already sits at
+// or beyond it according to its monitor, so the put would change nothing
+std::optional<double> pinned_limit(const PutAction &action);
+
+// Returns true if the type name is a numeric array, e.g. "double[]"
+bool is_array_type(const std::string &type_str);
+
+// Returns true if the type name is an integer scalar, e.g. "int" or "ubyte"
+bool is_integer_type(const std::string &type_str);
+
+// Stores src[i] + offset[i] in dst[i]
+void add_offset(const double *src, const double *offset, double *dst, size_t n);
+
+// Stores src[i] + offset in dst[i]
+void add_offset(const double *src, double offset, double *dst, size_t n);
+
+// Returns the current waveform plus a scalar or element-wise vector offset
+epics::pvData::shared_vector<const double> increment_array(const epics::pvData::shared_vector<const double> &current,
+							   const TargetVar &val);
+
+// Completion barrier for a group of puts issued together.
+// Puts complete on pvAccess worker threads and report here.
+class PutBarrier {
+  public:
+    using Callback = std::function<void(const std::vector<std::string> &errors)>;
+
+    // on_complete is called once, from the thread which finishes the last put
+    explicit PutBarrier(Callback on_complete = nullptr);
+
+    // Registers one more outstanding put to the named PV
+    void add(const std::string &pv_name);
+
+    // Records the completion of a put registered with add()
+    void done(const std::string &pv_name, const pvac::PutEvent &evt);
+
+    // Marks that no more puts will be added. The barrier cannot complete before this
+    void seal();
+
+    // Waits until every put has completed. Returns false on timeout
+    bool wait(double timeout);
+
+    // Returns a message for each failed, cancelled, or still outstanding put
+    std::vector<std::string> errors() const;
+
+  private:
+    // Calls on_complete if the barrier just completed, lock must be held
+    void check_complete(std::unique_lock<std::mutex> &lock);
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::multiset<std::string> pending_;
+    std::vector<std::string> errors_;
+    bool sealed_ = false;
+    Callback on_complete_;
+};
+
+using BarrierList = std::vector<std::shared_ptr<PutBarrier>>;
+
+// One asynchronous put of a PutAction. Increments are computed when the put
+// is built, from the monitor cache or from the value the put operation
+// fetched just before writing, so starting a put never blocks.
+// The put must already be registered with each of its barriers.
+class AsyncPut : public pvac::ClientChannel::PutCallback {
+  public:
+    using Callback = std::function<void(AsyncPut *put)>;
+
+    // on_done is called once when the put completes, fails, or expires
+    AsyncPut(const PutAction &action, const BarrierList &barriers, Callback on_done = nullptr);
+    ~AsyncPut();
+
+    AsyncPut(const AsyncPut &) = delete;
+    AsyncPut &operator=(const AsyncPut &) = delete;
+
+    // Issues the put, completion is reported to the barriers
+    void start();
+
+    // Cancels the put and reports it as timed out, unless it already
+    // completed or start() has not issued it yet
+    void expire();
+
+    // Returns true once start() has issued the put
+    bool issued() const { return issued_; }
+
+    // Returns the seconds since the put was built
+    double age() const;
+
+    const PutAction &action() const { return action_; }
+
+  private:
+    void putBuild(const epics::pvData::StructureConstPtr &build, Args &args) override;
+    void putDone(const pvac::PutEvent &evt) override;
+
+    // Reports the result exactly once
+    void complete(const pvac::PutEvent &evt);
+
+    PutAction action_;
+    BarrierList barriers_;
+    Callback on_done_;
+    std::optional<epics::pvData::shared_vector<const double>> cached_;
+    std::optional<double> sent_; // the result of a scalar increment
+    std::optional<epics::pvData::shared_vector<const double>> sent_array_; // the result of an array increment
+    const std::chrono::steady_clock::time_point started_;
+    std::atomic<bool> issued_{false}; // start() has issued the put and set op_
+    std::atomic<bool> finished_{false};
+    pvac::Operation op_;
+};
+
+// Returns the device part of a PV name, e.g. "ioc:m1" for "ioc:m1.STOP"
+std::string device_of(const std::string &pv_name);
+
+// Issues puts without blocking the caller. Only one put per PV is in flight
+// at a time. Puts submitted meanwhile wait in a per-PV queue, where an
+// absolute value replaces everything queued before it and consecutive
+// increments are summed, so a burst of keypresses costs at most one extra put.
+// Urgent puts skip the queues entirely.
+class PutScheduler {
+  public:
+    PutScheduler() = default;
+    ~PutScheduler();
+
+    PutScheduler(const PutScheduler &) = delete;
+    PutScheduler &operator=(const PutScheduler &) = delete;
+
+    // Queues a put behind any in-flight put to the same PV
+    void submit(const PutAction &action, const std::shared_ptr<PutBarrier> &barrier);
+
+    // Cancels every queued put to the same device and issues this put at once
+    void submit_urgent(const PutAction &action, const std::shared_ptr<PutBarrier> &barrier);
+
+    // Cancels puts which have been in flight for longer than timeout seconds
+    void expire(double timeout);
+
+  private:
+    struct Pending {
+	PutAction action;
+	BarrierList barriers;
+    };
+
+    struct Slot {
+	std::shared_ptr<AsyncPut> in_flight;
+	std::deque<Pending> queue;
+    };
+
+    // Called by an AsyncPut when it completes, starts the next queued put
+    void put_done(AsyncPut *put);
+
+    // Destroys completed puts, never called from a put callback
+    void reap();
+
+    std::mutex mutex_;
+    std::map<std::string, Slot> slots_;
+    std::vector<std::shared_ptr<AsyncPut>> urgent_;
+    std::vector<std::shared_ptr<AsyncPut>> retired_;
+};
+
+// Running statistics of end-to-end latency, from keypress to put completion
+class LatencyStats {
+  public:
+    void record(double seconds);
+
+    // Returns e.g. "n=12 min=1.2ms mean=2.0ms max=4.1ms"
+    std::string summary() const;
+
+  private:
+    mutable std::mutex mutex_;
+    size_t count_ = 0;
+    double total_ = 0.0;
+    double min_ = 0.0;
+    double max_ = 0.0;
+};
+
+// Issues all puts concurrently and waits for them on a single barrier.
+// A nonzero window limits how many are in flight at once, each completion
+// starting the next. Returns a message for every put which failed or did
+// not finish in time, puts never started count as not finished
+std::vector<std::string> execute_puts(const std::vector<PutAction> &actions, double timeout=3.0, size_t window=0);
+
+#endif
@@ -0,0 +1,126 @@
+#include <cmath>
+#include <sstream>
+
+#include <pv/pvData.h>
+#include <pv/createRequest.h>
+
+#include "pvcache.h"
+#include "trace.h"
+#include "metrics.h"
+
+// Returns the pvRequest for a monitor, only the value field is requested
+// so alarm and timestamp changes don't cause updates
+static epics::pvData::PVStructure::shared_pointer monitor_request(const MonitorOptions &options) {
+    std::string request = "field(value)";
+    if (options.queue_size > 0) {
+	request = "record[queueSize=" + std::to_string(options.queue_size) + "]" + request;
+    }
+    return epics::pvData::createRequest(request);
+}
+
+PVCache::PVCache(pvac::ClientChannel &channel, const MonitorOptions &options)
+    : options_(options), name_(channel.name()), monitor_(channel.monitor(this, monitor_request(options))) {}
+
+PVCache::~PVCache() {
+    // Make sure no callback can arrive once we are gone
+    monitor_.cancel();
+}
+
+std::optional<epics::pvData::shared_vector<const double>> PVCache::array() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return array_;
+}
+
+void PVCache::store_array(const epics::pvData::shared_vector<const double> &value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    array_ = value;
+    version_.fetch_add(1, std::memory_order_release);
+}
+
+std::optional<double> PVCache::number() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto num = std::get_if<double>(&scalar_)) {
+	return *num;
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> PVCache::string() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto str = std::get_if<std::string>(&scalar_)) {
+	return *str;
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> PVCache::text() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (array_) {
+	return "[" + std::to_string(array_->size()) + " values]";
+    } else if (auto num = std::get_if<double>(&scalar_)) {
+	std::ostringstream ss;
+	ss << *num;
+	return ss.str();
+    } else if (auto str = std::get_if<std::string>(&scalar_)) {
+	return *str;
+    }
+    return std::nullopt;
+}
+
+bool PVCache::in_deadband(double value) const {
+    auto current = std::get_if<double>(&scalar_);
+    if (not current or options_.deadband <= 0.0) {
+	return false;
+    }
+    const double limit = options_.deadband_percent ? std::abs(*current) * options_.deadband / 100.0 : options_.deadband;
+    return std::abs(value - *current) <= limit;
+}
+
+void PVCache::monitorEvent(const pvac::MonitorEvent &evt) {
+    if (evt.event != pvac::MonitorEvent::Data) {
+	// Fail, Cancel, or Disconnect: never hand out a stale value
+	if (evt.event == pvac::MonitorEvent::Disconnect) {
+	    metrics::monitor_disconnected();
+	    disconnected_ = true;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	array_.reset();
+	scalar_ = std::monostate();
+	version_.fetch_add(1, std::memory_order_release);
+	return;
+    }
+
+    if (disconnected_.exchange(false)) {
+	metrics::monitor_reconnected();
+    }
+    while (monitor_.poll()) {
+	tracing::instant("monitor", name_);
+	metrics::monitor_update();
+	const auto &root = monitor_.root;
+	if (auto field = root->getSubField<epics::pvData::PVScalarArray>("value")) {
+	    // getAs() only converts when the PV element type is not double,
+	    // otherwise the shared_vector simply references the monitor buffer
+	    epics::pvData::shared_vector<const double> value;
+	    field->getAs<double>(value);
+
+	    std::lock_guard<std::mutex> lock(mutex_);
+	    array_ = value;
+	} else if (auto field = root->getSubField<epics::pvData::PVString>("value")) {
+	    std::lock_guard<std::mutex> lock(mutex_);
+	    scalar_ = field->get();
+	} else if (auto field = root->getSubField<epics::pvData::PVScalar>("value")) {
+	    const double value = field->getAs<double>();
+	    std::lock_guard<std::mutex> lock(mutex_);
+	    if (in_deadband(value)) {
+		continue;
+	    }
+	    scalar_ = value;
+	} else if (auto field = root->getSubField<epics::pvData::PVScalar>("value.index")) {
+	    std::lock_guard<std::mutex> lock(mutex_);
+	    scalar_ = field->getAs<double>();
+	} else {
+	    continue;
+	}
+	version_.fetch_add(1, std::memory_order_release);
+    }
+}
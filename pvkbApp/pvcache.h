@@ -0,0 +1,77 @@
+#ifndef PVKB_PVCACHE_H
+#define PVKB_PVCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <variant>
+
+#include <pva/client.h>
+
+// Tuning for a monitored PV. queue_size maps to the pvRequest option
+// record[queueSize=N]. deadband filters updates of numeric scalars on the
+// client: an update is dropped unless it differs from the last kept value
+// by more than deadband, or by more than deadband percent of it
+struct MonitorOptions {
+    double deadband = 0.0;
+    bool deadband_percent = false;
+    unsigned queue_size = 0;
+};
+
+// Keeps the latest value of a PV up to date through a ca/pva monitor so
+// that increments can be computed locally without a get() round trip, and
+// readbacks can be displayed without polling.
+// Monitor callbacks arrive on pvAccess worker threads, so all access to
+// the cached value is guarded by a mutex. Updates only store the value,
+// formatting for display happens when the screen is redrawn.
+class PVCache : public pvac::ClientChannel::MonitorCallback {
+  public:
+    explicit PVCache(pvac::ClientChannel &channel, const MonitorOptions &options = MonitorOptions());
+    ~PVCache();
+
+    PVCache(const PVCache &) = delete;
+    PVCache &operator=(const PVCache &) = delete;
+
+    // Returns the most recent array value, or nullopt if the monitor
+    // has not delivered any data yet or the PV is disconnected.
+    // The returned vector shares the monitor's buffer, no copy is made.
+    std::optional<epics::pvData::shared_vector<const double>> array() const;
+
+    // Stores a waveform a put just wrote, so the next increment builds on it
+    // even if the monitor update for the put has not arrived yet
+    void store_array(const epics::pvData::shared_vector<const double> &value);
+
+    // Returns the most recent value of a numeric scalar PV, or nullopt
+    std::optional<double> number() const;
+
+    // Returns the most recent value of a string PV, or nullopt
+    std::optional<std::string> string() const;
+
+    // Returns the most recent value formatted for display,
+    // or nullopt if there is no value or the PV is disconnected
+    std::optional<std::string> text() const;
+
+    // Returns a counter which is incremented on every update, so a
+    // reader can cheaply tell whether anything changed since it last looked
+    uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+  private:
+    void monitorEvent(const pvac::MonitorEvent &evt) override;
+
+    // Returns true if a new numeric value is within the deadband of the
+    // current one, lock must be held
+    bool in_deadband(double value) const;
+
+    const MonitorOptions options_;
+    const std::string name_;
+    mutable std::mutex mutex_;
+    std::optional<epics::pvData::shared_vector<const double>> array_;
+    std::variant<std::monostate, double, std::string> scalar_;
+    std::atomic<uint64_t> version_{0};
+    std::atomic<bool> disconnected_{false};
+    pvac::Monitor monitor_;
+};
+
+#endif
@@ -1,26 +1,43 @@
+#include <algorithm>
+#include <chrono>
 #include <exception>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <optional>
 #include <map>
-#include <tuple>
+#include <set>
+#include <memory>
+#include <mutex>
 #include <variant>
+#include <vector>
 #include <ncurses.h>
+#include <unistd.h>
 
 #include <pva/client.h>
 #include <pv/caProvider.h>
 
 #include "toml++/toml.hpp"
 #include "argh.h"
-
-// Stores the value field of keybinding with the appropriate type
-// e.g. key_right = {pv="m1.TWF", value=1} 
-using TargetVar = std::variant<int, double, bool, std::string>;
-
-// Keybinding tuple (PVA channel, target value, boolean increment)
-using TupleVal = std::tuple<pvac::ClientChannel, TargetVar, bool>;
+#include "pvcache.h"
+#include "putops.h"
+#include "dispatch.h"
+#include "render.h"
+#include "registry.h"
+#include "filewatch.h"
+#include "configload.h"
+#include "trace.h"
+#include "auditlog.h"
+#include "metrics.h"
+#include "undo.h"
+#include "snapshot.h"
+#include "keyproto.h"
+#include "keynames.h"
+#include "keyseq.h"
+#include "rawinput.h"
 
 
 // Returns the value of the optional if present,
@@ -34,9 +51,11 @@ T expect(std::optional<T> optional, const std::string &msg) {
     }
 }
 
-// Returns an optional char given a string like "key_a" 
-// which can be interpreted by ncurses getch()
-std::optional<char> to_key_char(const std::string_view str) {
+// Returns the key codes given a binding name like "key_a", "key_f5" or
+// "key_ctrl_left", or a key sequence like "key_g m 1" or "key_ctrl-x r",
+// as reported by the input backends. See keynames.h for every name.
+// names receives the name of each key
+std::optional<std::vector<int>> to_key_codes(const std::string_view str, std::vector<std::string> &names) {
     
     static constexpr std::string_view key_prefix = "key_";
 
@@ -46,44 +65,50 @@ std::optional<char> to_key_char(const std::string_view str) {
 	return std::nullopt;
     }
     
-    // get everything after "key_"
-    std::string tmp_str(str.substr(key_prefix.length(),str.length()));
-
-    // check for special keys, then alpha keys
-    if (tmp_str == "up") {
-	return KEY_UP;
-    } else if (tmp_str == "down") {
-	return KEY_DOWN;
-    } else if (tmp_str == "right")  {
-	return KEY_RIGHT;
-    } else if (tmp_str == "left") {
-	return KEY_LEFT;
-    } else if (tmp_str == "enter") {
-	return '\n';
-    } else if (tmp_str == "space") {
-	return ' ';
-    } else if (tmp_str.length() > 1) {
+    // get everything after "key_", one key name per word
+    std::stringstream ss(std::string(str.substr(key_prefix.length())));
+    std::vector<int> keys;
+    for (std::string name; ss >> name;) {
+	const std::optional<int> code = key_code(name);
+	if (not code) {
+	    return std::nullopt;
+	}
+	keys.push_back(*code);
+	names.push_back(name);
+    }
+    if (keys.empty()) {
+	return std::nullopt;
+    }
+    return keys;
+}
+
+// Returns the binding code of a binding name, which for sequences is the
+// code the trie gave them
+std::optional<int> to_binding_code(const std::string_view str, const KeyTrie &sequences) {
+    std::vector<std::string> names;
+    const std::optional<std::vector<int>> keys = to_key_codes(str, names);
+    if (not keys) {
 	return std::nullopt;
-    } else { // alphanumeric char ('a','b',1,2,etc.)
-	const char alpha = tmp_str.at(0);
-	return std::isalnum(alpha) ? std::optional<char>(alpha) : std::nullopt;
     }
+    return keys->size() == 1 ? keys->front() : sequences.find(*keys);
 }
 
+// Returns the key which quits the program, a key name without "key_", default "q"
+int parse_quit_key(const toml::table &tbl) {
+    return expect(key_code(tbl["quit"].value_or("q")), "Invalid quit key");
+}
 
-// Returns an optional string of the type name of an EPICS PV given a pvac::ClientChannel
-std::optional<std::string> get_pv_type(pvac::ClientChannel &channel) {
-    std::optional<std::string> type_str;
-    try {
-	type_str = channel.get()->getStructure()->getField("value")->getID();
-    } catch (const std::exception &e) {
-	type_str = std::nullopt;	
+// Returns the key which undoes the last change, e.g. undo_key = "ctrl_z", if any
+std::optional<int> parse_undo_key(const toml::table &tbl) {
+    if (auto name = tbl["undo_key"].value<std::string>()) {
+	return expect(key_code(*name), "Invalid undo key");
     }
-    return type_str;
+    return std::nullopt;
 }
 
+
 // Returns an optional string of the type name of a variant
-// with possible types int, double, bool, or string
+// with possible types int, double, bool, string, or double[]
 std::optional<std::string> get_variant_type(const TargetVar& value) {
     std::string result;
     auto visitor = [&](auto&& arg) {
@@ -96,6 +121,8 @@ std::optional<std::string> get_variant_type(const TargetVar& value) {
 	    result = "bool";
         } else if constexpr (std::is_same_v<T, std::string>) {
 	    result = "string";
+	} else if constexpr (std::is_same_v<T, std::vector<double>>) {
+	    result = "double[]";
         }
     };
     std::visit(visitor, value);
@@ -107,7 +134,10 @@ bool check_type_match(const std::string &pv_type, const std::string &var_type) {
 
     bool type_match = true;
 
-    if (pv_type == "float" || pv_type == "double") {
+    if (is_array_type(pv_type)) {
+	// whole waveform, or a scalar offset for increment bindings
+	type_match = (var_type == "double[]" || var_type == "double" || var_type == "int");
+    } else if (pv_type == "float" || pv_type == "double") {
 	type_match = (var_type == "double" || var_type == "int");
     } else if (pv_type == "boolean") {
 	type_match = (var_type == "bool");
@@ -121,9 +151,20 @@ bool check_type_match(const std::string &pv_type, const std::string &var_type) {
 }
 
 // Attempts to store the value of the given toml::node in one of
-// string, integer, double, bool as a optional variant
+// string, integer, double, bool, or array of numbers as a optional variant
 std::optional<TargetVar> extract_variant_value(const toml::node &node) {
-    if (node.is_string()) {
+    if (auto arr = node.as_array()) {
+	std::vector<double> values;
+	values.reserve(arr->size());
+	for (const auto &elem : *arr) {
+	    if (auto num = elem.value<double>()) {
+		values.push_back(*num);
+	    } else {
+		return std::nullopt;
+	    }
+	}
+	return values;
+    } else if (node.is_string()) {
 	return *node.value<std::string>();
     } else if (node.is_integer()) {
 	return *node.value<int>();
@@ -136,147 +177,691 @@ std::optional<TargetVar> extract_variant_value(const toml::node &node) {
     }
 }
 
-// Returns a map from char keys to pv channel and target value
-std::map<char, TupleVal> parse_keybindings(const toml::table &tbl, pvac::ClientProvider &provider, const std::string &ioc_prefix) {
-    std::stringstream err_ss;
-    std::map<char, TupleVal> channel_map;
-    
-    if (auto keybindings_tbl = tbl["keybindings"].as_table()) {
-	for (const auto &[key, value] : *keybindings_tbl) {
-	    // key is e.g. 'key_right'
-	    // value is e.g. '{pv="m1.TWF", value=1}'
-	    // std::cout << key << ": ";
-	    // std::cout << *value.as_table() << " -> ";
-	    const auto keybind = *value.as_table();
-
-	    // Get the name of the PV to write to
-	    std::string pv_name = expect(keybind["pv"].value<std::string>(), "Missing or invalid PV name");
-	
-	    // Create channel for the pv
-	    pvac::ClientChannel channel;
-	    pv_name =  ioc_prefix + pv_name;
-	    try {
-		channel = pvac::ClientChannel(provider.connect(pv_name));
-		channel.get();
-	    } catch (const std::exception &e) {
-		throw std::runtime_error("Failed to connect to PV");
+// Returns the unprefixed names of the high and low limit PVs of a put, if it
+// has limits: "drive" for DRVH/DRVL, "display" for HOPR/LOPR of the PV's
+// record, or the two PV names, e.g. limits=["m1.HLM", "m1.LLM"]
+std::optional<std::pair<std::string, std::string>> limit_pv_names(const toml::table &keybind) {
+    const std::optional<std::string> pv_name = keybind["pv"].value<std::string>();
+    const toml::node *limits = keybind.get("limits");
+    if (not limits or not pv_name) {
+	return std::nullopt;
+    }
+    const std::string record = device_of(*pv_name);
+    if (auto arr = limits->as_array(); arr and arr->size() == 2 and (*arr)[0].is_string() and (*arr)[1].is_string()) {
+	return std::make_pair(*(*arr)[0].value<std::string>(), *(*arr)[1].value<std::string>());
+    } else if (limits->value<std::string>() == "drive") {
+	return std::make_pair(record + ".DRVH", record + ".DRVL");
+    } else if (limits->value<std::string>() == "display") {
+	return std::make_pair(record + ".HOPR", record + ".LOPR");
+    }
+    throw std::runtime_error("Invalid limits of " + *pv_name + ", expected \"drive\", \"display\" or [high PV, low PV]");
+}
+
+// Returns the puts described by a table like '{pv="m1.TWF", value=1}',
+// one for each IOC prefix
+std::vector<PutAction> parse_action(const toml::table &keybind, ChannelRegistry &registry,
+				    const std::vector<std::string> &ioc_prefixes) {
+    PutAction action;
+
+    // Get variant value pv target value from toml node
+    const toml::node *value_node = keybind["value"].node();
+    action.value = expect(value_node ? extract_variant_value(*value_node) : std::nullopt, "Invalid value");
+    const std::string var_type_str = expect(get_variant_type(action.value),
+				     "get_variant_type() failed. Check type of pv value");
+
+    // Get flag for increment mode (default: false)
+    // only supported for numbers, not strings
+    if (var_type_str == "int" or var_type_str == "double" or var_type_str == "double[]") {
+	action.increment = keybind["increment"].value<bool>().value_or(false);
+    }
+
+    // Urgent puts (e.g. motor stops) skip the queues of normal puts
+    const std::string priority = keybind["priority"].value_or("normal");
+    if (priority == "urgent") {
+	action.urgent = true;
+    } else if (priority != "normal") {
+	throw std::runtime_error("Invalid priority '" + priority + "', expected \"normal\" or \"urgent\"");
+    }
+
+    // Get the names of the PVs to write to and create channels for them
+    const std::string pv_name = expect(keybind["pv"].value<std::string>(), "Missing or invalid PV name");
+    std::vector<std::string> pv_names;
+    for (const auto &prefix : ioc_prefixes) {
+	pv_names.push_back(prefix + pv_name);
+    }
+    registry.connect(pv_names);
+
+    std::vector<PutAction> actions;
+    for (const auto &target_name : pv_names) {
+	PutAction &target = actions.emplace_back(action);
+	target.pv_name = target_name;
+	target.channel = registry.channel(target_name);
+
+	// Get type of PV
+	target.pv_type = registry.pv_type(target_name);
+
+	// Ensure desired value type matches PV type
+	if (not check_type_match(target.pv_type, var_type_str)) {
+	    throw std::runtime_error("Type mismatch between target value and PV value for " + target.pv_name);
+	}
+
+	// Array increments add to the monitored waveform instead of fetching it
+	// on every keypress, a scalar offset is only meaningful as an increment
+	if (is_array_type(target.pv_type)) {
+	    if (target.increment) {
+		target.cache = registry.cache(target_name);
+	    } else if (var_type_str != "double[]") {
+		throw std::runtime_error("Scalar value for array PV requires increment=true");
+	    }
+	}
+    }
+
+    // Increments with limits are clamped to the monitored limit fields, and
+    // not sent at all while the PV sits at the limit they move towards
+    if (auto limit_names = limit_pv_names(keybind)) {
+	if (not action.increment or is_array_type(actions.front().pv_type)) {
+	    throw std::runtime_error("limits require increment=true on a scalar PV, " + pv_name);
+	}
+	for (size_t i = 0; i < actions.size(); i++) {
+	    const std::string high = ioc_prefixes[i] + limit_names->first;
+	    const std::string low = ioc_prefixes[i] + limit_names->second;
+	    registry.connect({high, low});
+	    actions[i].limits = std::make_shared<const PutLimits>(PutLimits{registry.cache(high), registry.cache(low), high, low});
+	    actions[i].cache = registry.cache(actions[i].pv_name);
+	}
+    }
+
+    return actions;
+}
+
+// Returns the IOC prefixes from --prefix (comma separated) or from the config
+// file, where prefix may be a string or an array of strings. Every binding is
+// fanned out to all prefixes, e.g. to control the same axis on identical IOCs
+std::vector<std::string> parse_prefixes(const toml::table &tbl, const std::string &cmdl_prefix) {
+    std::vector<std::string> prefixes;
+    if (not cmdl_prefix.empty()) {
+	std::stringstream ss(cmdl_prefix);
+	std::string prefix;
+	while (std::getline(ss, prefix, ',')) {
+	    prefixes.push_back(prefix);
+	}
+    } else if (auto prefix_array = tbl["prefix"].as_array()) {
+	for (const auto &item : *prefix_array) {
+	    prefixes.push_back(expect(item.value<std::string>(), "Prefix list must only contain strings"));
+	}
+    } else {
+	prefixes.push_back(tbl["prefix"].value_or(""));
+    }
+
+    if (prefixes.empty()) {
+	prefixes.push_back("");
+    }
+    return prefixes;
+}
+
+// Returns the table of a keybinding which names its readback PV,
+// e.g. readback="m1.RBV". For a list of puts, the first table which has one
+const toml::table *find_readback(const toml::node &value) {
+    if (auto keybind = value.as_table(); keybind and keybind->contains("readback")) {
+	return keybind;
+    } else if (auto macro = value.as_array()) {
+	for (const auto &item : *macro) {
+	    if (auto keybind = item.as_table(); keybind and keybind->contains("readback")) {
+		return keybind;
 	    }
+	}
+    }
+    return nullptr;
+}
 
-	    // Get the char for the cooresponding key for ncurses 
-	    const char key_char = expect(to_key_char(key), "Invalid key");
+// Returns the puts of a {pv=..., value=...} table or a list of such tables
+std::vector<PutAction> parse_puts(const toml::node &node, ChannelRegistry &registry,
+				  const std::vector<std::string> &ioc_prefixes) {
+    std::vector<PutAction> actions;
+    if (auto keybind = node.as_table()) {
+	actions = parse_action(*keybind, registry, ioc_prefixes);
+    } else if (auto macro = node.as_array()) {
+	for (const auto &item : *macro) {
+	    auto keybind = item.as_table();
+	    if (!keybind) {
+		throw std::runtime_error("Keybinding list must only contain {pv=..., value=...} tables");
+	    }
+	    std::vector<PutAction> item_actions = parse_action(*keybind, registry, ioc_prefixes);
+	    actions.insert(actions.end(), item_actions.begin(), item_actions.end());
+	}
+    }
+    return actions;
+}
 
-	    // Get type of PV
-	    const std::string pv_type_str = expect(get_pv_type(channel),"PV is not a supported type");
+// Reads what a keybinding does when its key is released, either
+// {on_press={pv="m1.JOGF", value=1}, on_release={pv="m1.JOGF", value=0}} or
+// {pv="m1.JOGF", value=1, mode="hold", stop={pv="m1.JOGF", value=0}, hold_gap=0.6}.
+// hold_gap must be longer than the terminal's delay before auto-repeat starts
+void parse_release(const toml::table &keybind, ChannelRegistry &registry,
+		   const std::vector<std::string> &ioc_prefixes, Binding &binding) {
+    const std::string mode = keybind["mode"].value_or(keybind.contains("on_release") ? "hold" : "press");
+    if (mode == "press") {
+	return;
+    } else if (mode != "hold") {
+	throw std::runtime_error("Invalid mode '" + mode + "', expected \"press\" or \"hold\"");
+    }
 
-	    // Get variant value pv target value from toml node
-	    TargetVar pv_val = expect(extract_variant_value(*keybind["value"].node()), "Invalid value");
-	    const std::string var_type_str = expect(get_variant_type(pv_val),
-					 "get_variant_type() failed. Check type of pv value");
-	
-	    // Get flag for increment mode (default: false)
-	    // only supported for numbers, not strings
-	    bool increment = false;
-	    if (var_type_str == "int" or var_type_str == "double") {
-		increment = keybind["increment"].value<bool>().value_or(false);
+    const toml::node *release = keybind.contains("on_release") ? keybind.get("on_release") : keybind.get("stop");
+    if (!release) {
+	throw std::runtime_error("Hold keybinding needs an on_release={pv=..., value=...} table");
+    }
+    binding.hold = true;
+    binding.release_actions = parse_puts(*release, registry, ioc_prefixes);
+    if (binding.release_actions.empty()) {
+	throw std::runtime_error("Invalid on_release puts");
+    }
+    binding.hold_gap = keybind["hold_gap"].value_or(0.6);
+    if (binding.hold_gap <= 0.0) {
+	throw std::runtime_error("hold_gap must be positive");
+    }
+}
+
+// Reads the rate limit of a keybinding, e.g. max_rate=5 (presses per second),
+// burst=2 (presses let through at once), and throttle="drop" or "coalesce"
+void parse_rate_limit(const toml::table &keybind, Binding &binding) {
+    binding.max_rate = keybind["max_rate"].value_or(0.0);
+    binding.burst = keybind["burst"].value_or(1.0);
+    if (binding.max_rate < 0.0 or binding.burst < 1.0) {
+	throw std::runtime_error("max_rate must not be negative and burst must be at least 1");
+    }
+    const std::string throttle = keybind["throttle"].value_or("drop");
+    if (throttle == "coalesce") {
+	binding.coalesce = true;
+    } else if (throttle != "drop") {
+	throw std::runtime_error("Invalid throttle '" + throttle + "', expected \"drop\" or \"coalesce\"");
+    }
+}
+
+// Returns the monitor tuning of a readback, e.g. deadband=0.01 (absolute),
+// deadband="0.5%" (relative to the current value), and queue_size=2
+MonitorOptions parse_monitor_options(const toml::table &keybind) {
+    MonitorOptions options;
+    if (auto deadband = keybind["deadband"].value<double>()) {
+	options.deadband = *deadband;
+    } else if (auto percent = keybind["deadband"].value<std::string>()) {
+	try {
+	    if (percent->empty() or percent->back() != '%') {
+		throw std::invalid_argument(*percent);
 	    }
+	    options.deadband = std::stod(percent->substr(0, percent->length() - 1));
+	    options.deadband_percent = true;
+	} catch (const std::exception &e) {
+	    throw std::runtime_error("Invalid deadband '" + *percent + "', expected a number or a percentage like \"1%\"");
+	}
+    }
+    if (options.deadband < 0.0) {
+	throw std::runtime_error("Deadband must not be negative");
+    }
+
+    const int64_t queue_size = keybind["queue_size"].value_or(int64_t(0));
+    if (queue_size < 0) {
+	throw std::runtime_error("queue_size must not be negative");
+    }
+    options.queue_size = static_cast<unsigned>(queue_size);
+    return options;
+}
+
+// Returns a map from keys to pv channels and target values, given a table of keybindings.
+// Key sequences are added to sequences
+BindingMap parse_bindings(const toml::table &keybindings_tbl, ChannelRegistry &registry,
+			  const std::vector<std::string> &ioc_prefixes, KeyTrie &sequences) {
+    BindingMap channel_map;
+
+    for (const auto &[key, value] : keybindings_tbl) {
+	// key is e.g. 'key_right'
+	// value is e.g. '{pv="m1.TWF", value=1}' or an array of such tables
 
-	    // Ensure desired value type matches PV type
-	    if (not check_type_match(pv_type_str, var_type_str)) {
-		throw std::runtime_error("Type mismatch between target value and PV value");
+	// Get the code of the cooresponding key or key sequence
+	std::vector<std::string> names;
+	const std::vector<int> keys = expect(to_key_codes(key, names), "Invalid key " + std::string(key.str()));
+	const int key_char = keys.size() == 1 ? keys.front() : sequences.add(keys, names);
+
+	Binding binding;
+	auto keybind = value.as_table();
+	const toml::node *press = keybind and keybind->contains("on_press") ? keybind->get("on_press") : &value;
+	binding.actions = parse_puts(*press, registry, ioc_prefixes);
+	for (const auto &action : binding.actions) {
+	    binding.urgent = binding.urgent or action.urgent;
+	}
+	if (binding.actions.empty()) {
+	    throw std::runtime_error("Invalid keybinding " + std::string(key.str()));
+	}
+
+	// Hold bindings put once on the first press and once more when the key is released
+	if (keybind) {
+	    parse_release(*keybind, registry, ioc_prefixes, binding);
+	    parse_rate_limit(*keybind, binding);
+	}
+	if (binding.hold and keys.size() > 1) {
+	    throw std::runtime_error("Key sequence " + std::string(key.str()) + " cannot be a hold binding");
+	}
+
+	// Readback PVs are monitored and displayed next to the binding
+	if (auto readback_tbl = find_readback(value)) {
+	    const std::string readback = expect((*readback_tbl)["readback"].value<std::string>(),
+						"Invalid readback PV name");
+	    const MonitorOptions options = parse_monitor_options(*readback_tbl);
+	    for (const auto &prefix : ioc_prefixes) {
+		binding.readback_pvs.push_back(prefix + readback);
+	    }
+	    registry.connect(binding.readback_pvs);
+	    for (const auto &pv_name : binding.readback_pvs) {
+		binding.readbacks.push_back(registry.cache(pv_name, options));
 	    }
+	}
 
-	    // add keybinding to the map
-	    channel_map[key_char] = std::make_tuple(channel, pv_val, increment);
+	// The audit log records which key issued each put
+	for (auto &action : binding.actions) {
+	    action.key = key_char;
 	}
-    } else {
-	throw std::runtime_error("No keybindings section in TOML file");
+	for (auto &action : binding.release_actions) {
+	    action.key = key_char;
+	}
+
+	// add keybinding to the map
+	channel_map[key_char] = binding;
     }
 
     return channel_map;
 }
 
-// Executes a ca/pva put of the given value to the given channel
-// We assume that the PV and value types match
-void execute_put(pvac::ClientChannel &channel, TargetVar val, bool increment=false) {
-    const std::string pv_type_str = expect(get_pv_type(channel), "Failed to get pv_type_str");
-    const std::string var_type_str = expect(get_variant_type(val), "Failed to get var_type_str");
+// Returns str with every "{name}" replaced by the value of name in vars
+std::string substitute(std::string str, const std::map<std::string, std::string> &vars) {
+    for (const auto &[name, value] : vars) {
+	const std::string placeholder = "{" + name + "}";
+	for (size_t pos = str.find(placeholder); pos != std::string::npos; pos = str.find(placeholder, pos + value.length())) {
+	    str.replace(pos, placeholder.length(), value);
+	}
+    }
+    return str;
+}
 
-    std::string target_field = "value";
-    if (pv_type_str == "enum_t") {
-	target_field = "value.index";
+// Replaces the placeholders in every string of a keybinding, e.g. pv="{axis}.TWF"
+void substitute_strings(toml::node &node, const std::map<std::string, std::string> &vars) {
+    if (auto str = node.as_string()) {
+	*str = substitute(str->get(), vars);
+    } else if (auto table = node.as_table()) {
+	for (auto &&[key, value] : *table) {
+	    substitute_strings(value, vars);
+	}
+    } else if (auto array = node.as_array()) {
+	for (auto &item : *array) {
+	    substitute_strings(item, vars);
+	}
     }
-    
-    if (increment) {
-	if (var_type_str == "int") {
-	    const int current_val = channel.get()->getSubFieldT<epics::pvData::PVInt>("value")->getAs<int>();
-	    const int inc_val = std::get<int>(val);
-	    channel.put().set(target_field, current_val + inc_val).exec();
-	} else {
-	    const double current_val = channel.get()->getSubFieldT<epics::pvData::PVDouble>("value")->getAs<double>();
-	    const double inc_val = std::get<double>(val);
-	    channel.put().set(target_field, current_val + inc_val).exec();
+}
+
+// Returns the strings of a template field like axes=["m1", "m2"], or an empty list if it is missing
+std::vector<std::string> template_values(const toml::table &template_tbl, const std::string &field) {
+    std::vector<std::string> values;
+    if (auto array = template_tbl[field].as_array()) {
+	for (const auto &item : *array) {
+	    values.push_back(expect(item.value<std::string>(), "Template " + field + " must only contain strings"));
+	}
+    }
+    return values;
+}
+
+// Expands each [[template]] of a section into its [keybindings], e.g.
+//   [[template]]
+//   axes = ["m1", "m2", "m3"]
+//   keys = ["1", "2", "3"]
+//   [template.keybindings]
+//   "key_{key} right" = {pv="{axis}.TWF", value=1}
+// binds "key_1 right" to m1.TWF, "key_2 right" to m2.TWF and so on.
+// {axis} and {key} are taken from axes and keys, which must be the same
+// length, and {index} counts the axes from 1. The section is the top level
+// table or a [layers.<name>] table
+void expand_templates(toml::table &section) {
+    auto template_array = section["template"].as_array();
+    if (!template_array) {
+	return;
+    }
+    if (!section.contains("keybindings")) {
+	section.insert("keybindings", toml::table());
+    }
+    toml::table &keybindings = *section["keybindings"].as_table();
+
+    for (const auto &item : *template_array) {
+	auto template_tbl = item.as_table();
+	auto template_bindings = template_tbl ? (*template_tbl)["keybindings"].as_table() : nullptr;
+	if (!template_bindings) {
+	    throw std::runtime_error("Template must be a table with a keybindings table");
+	}
+	const std::vector<std::string> axes = template_values(*template_tbl, "axes");
+	const std::vector<std::string> keys = template_values(*template_tbl, "keys");
+	if (axes.empty()) {
+	    throw std::runtime_error("Template needs a list of axes");
+	} else if (not keys.empty() and keys.size() != axes.size()) {
+	    throw std::runtime_error("Template keys and axes must be the same length");
+	}
+
+	for (size_t i = 0; i < axes.size(); i++) {
+	    std::map<std::string, std::string> vars = {{"axis", axes[i]}, {"index", std::to_string(i + 1)}};
+	    if (not keys.empty()) {
+		vars["key"] = keys[i];
+	    }
+	    for (const auto &[key, value] : *template_bindings) {
+		const std::string name = substitute(std::string(key.str()), vars);
+		if (keybindings.contains(name)) {
+		    throw std::runtime_error("Template binding " + name + " is already bound");
+		}
+		if (auto table = value.as_table()) {
+		    toml::table binding = *table;
+		    substitute_strings(binding, vars);
+		    keybindings.insert(name, std::move(binding));
+		} else if (auto array = value.as_array()) {
+		    toml::array binding = *array;
+		    substitute_strings(binding, vars);
+		    keybindings.insert(name, std::move(binding));
+		} else {
+		    throw std::runtime_error("Invalid template keybinding " + name);
+		}
+	    }
+	}
+    }
+    section.erase("template");
+}
+
+// Expands the templates of the top level and of every layer
+void expand_all_templates(toml::table &tbl) {
+    expand_templates(tbl);
+    if (auto layers_tbl = tbl["layers"].as_table()) {
+	for (auto &&[name, value] : *layers_tbl) {
+	    if (auto layer_tbl = value.as_table()) {
+		expand_templates(*layer_tbl);
+	    }
 	}
-    } else {
-	if (var_type_str == "int") {
-	    channel.put().set(target_field, std::get<int>(val)).exec();
-	} else if (var_type_str == "double") {
-	    channel.put().set(target_field, std::get<double>(val)).exec();
-	} else if (var_type_str == "string") {
-	    channel.put().set(target_field, std::get<std::string>(val)).exec();
-	} 
     }
 }
 
-// Executes the ca/pva puts to the PVs specfied in the put array in toml file
-void do_prelim_puts(const toml::table &tbl, pvac::ClientProvider &provider, const std::string &ioc_prefix) {
+// Adds the prefixed names of the put and, unless readbacks is false, the
+// readback and limit PVs found anywhere in a keybinding to pv_names.
+// Invalid entries are left for parse_bindings to report
+void collect_pv_names(const toml::node &node, const std::vector<std::string> &ioc_prefixes,
+		      std::vector<std::string> &pv_names, bool readbacks = true) {
+    if (auto table = node.as_table()) {
+	std::optional<std::pair<std::string, std::string>> limit_names;
+	try {
+	    limit_names = readbacks ? limit_pv_names(*table) : std::nullopt;
+	} catch (const std::exception &) {
+	    // Reported by parse_bindings
+	}
+	if (limit_names) {
+	    for (const auto &prefix : ioc_prefixes) {
+		pv_names.push_back(prefix + limit_names->first);
+		pv_names.push_back(prefix + limit_names->second);
+	    }
+	}
+	for (const char *field : {"pv", "readback"}) {
+	    if (field == std::string_view("readback") and not readbacks) {
+		continue;
+	    }
+	    if (auto pv_name = (*table)[field].value<std::string>()) {
+		for (const auto &prefix : ioc_prefixes) {
+		    pv_names.push_back(prefix + *pv_name);
+		}
+	    }
+	}
+	for (const auto &[key, value] : *table) {
+	    collect_pv_names(value, ioc_prefixes, pv_names, readbacks);
+	}
+    } else if (auto array = node.as_array()) {
+	for (const auto &item : *array) {
+	    collect_pv_names(item, ioc_prefixes, pv_names, readbacks);
+	}
+    }
+}
+
+// Gives every put of the bindings a monitor cache of its PV, which the undo
+// stack reads the value before the put from
+void monitor_for_undo(BindingMap &bindings, ChannelRegistry &registry) {
+    for (auto &[key_char, binding] : bindings) {
+	for (auto &action : binding.actions) {
+	    if (not action.cache) {
+		action.cache = registry.cache(action.pv_name);
+	    }
+	}
+    }
+}
+
+// Returns the base layer from [keybindings] and each layer from [layers.<name>], e.g.
+//   [layers.fine]
+//   key = "f2"
+//   [layers.fine.keybindings]
+//   key_up = {pv="m1.TWV", value=0.01, increment=true}
+// A layer keeps the base layer's bindings for keys it does not rebind.
+// Layers share one ChannelRegistry, so a PV used by several layers is connected once.
+// Every PV is connected in one batch up front, so a config expanded from
+// templates waits about one connect timeout rather than one per binding
+std::shared_ptr<const Keymap> parse_keymap(const toml::table &tbl, ChannelRegistry &registry,
+					   const std::vector<std::string> &ioc_prefixes, KeyTrie &sequences) {
+    auto keybindings_tbl = tbl["keybindings"].as_table();
+    if (!keybindings_tbl) {
+	throw std::runtime_error("No keybindings section in TOML file");
+    }
+    std::vector<std::string> pv_names;
+    collect_pv_names(*keybindings_tbl, ioc_prefixes, pv_names);
+    if (auto layers_tbl = tbl["layers"].as_table()) {
+	collect_pv_names(*layers_tbl, ioc_prefixes, pv_names);
+    }
+    registry.connect(pv_names);
+
+    auto keymap = std::make_shared<Keymap>();
+    const std::optional<int> undo_key = parse_undo_key(tbl);
+    BindingMap base = parse_bindings(*keybindings_tbl, registry, ioc_prefixes, sequences);
+    if (undo_key) {
+	if (base.count(*undo_key) > 0) {
+	    throw std::runtime_error("Undo key is already bound");
+	}
+	monitor_for_undo(base, registry);
+    }
+    keymap->layers.push_back(std::make_unique<const Layer>("base", 0, base));
+
+    if (auto layers_tbl = tbl["layers"].as_table()) {
+	for (const auto &[name, value] : *layers_tbl) {
+	    auto layer_tbl = value.as_table();
+	    if (!layer_tbl) {
+		throw std::runtime_error("Layer " + std::string(name.str()) + " must be a table");
+	    }
+	    const int key = expect(key_code((*layer_tbl)["key"].value_or(std::string())),
+				   "Invalid or missing key of layer " + std::string(name.str()));
+	    if (base.count(key) > 0 or keymap->layer_of(key) or key == undo_key) {
+		throw std::runtime_error("Key of layer " + std::string(name.str()) + " is already bound");
+	    }
+
+	    BindingMap bindings = base;
+	    if (auto layer_bindings = (*layer_tbl)["keybindings"].as_table()) {
+		for (auto &[key_char, binding] : parse_bindings(*layer_bindings, registry, ioc_prefixes, sequences)) {
+		    bindings[key_char] = std::move(binding);
+		}
+	    }
+	    if (undo_key) {
+		if (bindings.count(*undo_key) > 0) {
+		    throw std::runtime_error("Undo key is bound in layer " + std::string(name.str()));
+		}
+		monitor_for_undo(bindings, registry);
+	    }
+	    keymap->layers.push_back(std::make_unique<const Layer>(std::string(name.str()), key, std::move(bindings)));
+	}
+    }
+
+    // max_rate = 10 limits the presses sent to the PVs of every IOC prefix,
+    // max_rate = {"ioc1:" = 10} those of the named prefixes only
+    if (auto rate = tbl["max_rate"].value<double>()) {
+	for (const auto &prefix : ioc_prefixes) {
+	    keymap->prefix_rates[prefix] = *rate;
+	}
+    } else if (auto rates = tbl["max_rate"].as_table()) {
+	for (const auto &[prefix, rate] : *rates) {
+	    keymap->prefix_rates[std::string(prefix.str())] =
+		expect(rate.value<double>(), "Invalid max_rate of prefix " + std::string(prefix.str()));
+	}
+    }
+    for (const auto &[prefix, rate] : keymap->prefix_rates) {
+	if (rate <= 0.0) {
+	    throw std::runtime_error("max_rate of prefix '" + prefix + "' must be positive");
+	}
+    }
+
+    // A single key which also starts a sequence fires when the sequence is cut short
+    for (const auto &layer : keymap->layers) {
+	for (const auto &[key_char, binding] : layer->bindings) {
+	    if (key_char < sequence_code_base) {
+		sequences.add_prefix_key(key_char);
+	    }
+	}
+    }
+
+    return keymap;
+}
+
+// Executes the ca/pva puts to the PVs specfied in the put array in toml file.
+// These run one at a time and in order, since later puts may depend on earlier ones.
+// Each put goes to all IOC prefixes at once
+void do_prelim_puts(const toml::table &tbl, ChannelRegistry &registry, const std::vector<std::string> &ioc_prefixes) {
     if (auto put_array = tbl["put"].as_array()) {
 	for (const auto &item: *put_array) {
 	    if (auto table = item.as_table()) {
-		
-		// Get the PV name
-		std::string pv_name = expect(table->get("pv")->value<std::string>(),"Bad or missing PV name");
-		pv_name = ioc_prefix + pv_name;
-
-		// Create channel for the pv
-		pvac::ClientChannel channel;
-		try {
-		    channel = pvac::ClientChannel(provider.connect(pv_name));
-		    channel.get();
-		} catch (const std::exception &e) {
-		    throw std::runtime_error("Failed to connect to PV");
+		std::vector<PutAction> actions = parse_action(*table, registry, ioc_prefixes);
+		for (auto &action : actions) {
+		    action.increment = false;
+		    action.urgent = false;
 		}
 
-		// Get the PV target value
-		TargetVar val = expect(
-		    extract_variant_value(*table->get("value")),
-		    "Bad or missing value in put list"
-		);
-
-		// Ensure desired value type matches PV type
-		const std::string pv_type_str = expect(get_pv_type(channel), "Failed to get pv_type_str");
-		const std::string var_type_str = expect(get_variant_type(val), "Failed to get var_type_str");
-		if (not check_type_match(pv_type_str, var_type_str)) {
-		    throw std::runtime_error("Type mismatch between target value and PV value");
+		const std::vector<std::string> errors = execute_puts(actions);
+		if (not errors.empty()) {
+		    throw std::runtime_error(format_errors(errors, actions.size()));
 		}
-	    
-		// Puts the value to the channel, assumes the types match
-		execute_put(channel, val);
 	    }
-	    
-	} 
+	}
+    }
+}
+
+// Returns the names of all PVs used by the keybindings of every layer
+std::set<std::string> used_pv_names(const Keymap &keymap) {
+    std::set<std::string> pv_names;
+    for (const auto &layer : keymap.layers) {
+	for (const auto &[key_char, binding] : layer->bindings) {
+	    for (const auto *actions : {&binding.actions, &binding.release_actions}) {
+		for (const auto &action : *actions) {
+		    pv_names.insert(action.pv_name);
+		    if (action.limits) {
+			pv_names.insert({action.limits->high_pv, action.limits->low_pv});
+		    }
+		}
+	    }
+	    pv_names.insert(binding.readback_pvs.begin(), binding.readback_pvs.end());
+	}
+    }
+    return pv_names;
+}
+
+// A config reloaded off the input thread, applied once it is complete
+struct Reload {
+    toml::table tbl;
+    std::vector<std::string> ioc_prefixes;
+    std::shared_ptr<KeyTrie> sequences;
+    std::shared_ptr<const Keymap> keymap;
+    size_t connected; // channels the new bindings added
+};
+
+// Reads the config again and connects every PV of its bindings. Run on a
+// worker thread, as connecting may wait up to the connect timeout; the
+// caller must not touch loader or registry until it returns
+Reload reload_config(ConfigLoader &loader, ChannelRegistry &registry, const std::string &toml_path,
+		     const std::string &cmdl_prefix) {
+    Reload reload;
+    reload.tbl = loader.load(toml_path);
+    expand_all_templates(reload.tbl);
+    reload.ioc_prefixes = parse_prefixes(reload.tbl, cmdl_prefix);
+    const size_t before = registry.size();
+    reload.sequences = std::make_shared<KeyTrie>();
+    reload.keymap = parse_keymap(reload.tbl, registry, reload.ioc_prefixes, *reload.sequences);
+    reload.connected = registry.size() - before;
+    return reload;
+}
+
+// Returns the key queue backpressure metrics as one line
+std::string format_queue_stats(const KeyDispatcher &dispatcher) {
+    return "Key queue: " + std::to_string(dispatcher.depth()) + " queued, high-water "
+	+ std::to_string(dispatcher.high_water()) + "/" + std::to_string(KeyDispatcher::queue_capacity)
+	+ ", " + std::to_string(dispatcher.dropped()) + " dropped, " + std::to_string(dispatcher.throttled())
+	+ " throttled";
+}
+
+// Prints one put of a keybinding, e.g. 'm1.TWV += 0.1'
+void show_action(std::stringstream &ss, const toml::table &entry_table) {
+    if (entry_table["increment"]) {
+	ss << entry_table["pv"] << " += ";
+    } else {
+	ss << entry_table["pv"] << " = ";
+    }
+    if (entry_table["value"].value<float>().has_value()) {
+	ss << entry_table["value"].value<float>().value();
+    } else if (auto arr = entry_table["value"].as_array()) {
+	ss << "[" << arr->size() << " values]";
+    }
+    if (entry_table["priority"].value_or(std::string()) == "urgent") {
+	ss << " (urgent)";
     }
 }
 
-void show_keybindings(const toml::table &tbl) {
+// Prints the puts of a keybinding, including those sent when the key is released
+void show_puts(std::stringstream &ss, const toml::node &node) {
+    if (auto table = node.as_table()) {
+	if (auto press = table->get("on_press")) {
+	    show_puts(ss, *press);
+	} else {
+	    show_action(ss, *table);
+	}
+	if (auto release = table->get("on_release")) {
+	    ss << ", on release ";
+	    show_puts(ss, *release);
+	} else if (auto stop = table->get("stop"); stop and (*table)["mode"].value_or(std::string()) == "hold") {
+	    ss << " while held, then ";
+	    show_puts(ss, *stop);
+	}
+    } else if (auto macro = node.as_array()) {
+	for (size_t i = 0; i < macro->size(); i++) {
+	    ss << (i > 0 ? ", " : "");
+	    show_puts(ss, *macro->get(i));
+	}
+    }
+}
+
+// Screen position of each binding line, used to draw readback values
+struct ReadbackLayout {
+    std::vector<std::map<int, int>> rows; // by layer, the base layer first, then by key code
+    int column = 0;
+};
+
+// Prints the keybindings and returns where their readbacks go
+ReadbackLayout show_keybindings(const toml::table &tbl, const std::vector<std::string> &ioc_prefixes,
+			       const KeyTrie &sequences) {
+    ReadbackLayout layout;
+    layout.rows.emplace_back();
     init_pair(1, COLOR_BLUE, COLOR_BLACK);
     auto keybindings = tbl["keybindings"].as_table();
-    const char quit_char = *tbl["quit"].value_or("q");
+    const std::string quit_name = tbl["quit"].value_or("q");
     attron(COLOR_PAIR(1));
     printw("--------------\n");
     printw("     PVKB\n");
     printw("--------------\n");
     attroff(COLOR_PAIR(1));
-    printw("Type %c to quit\n\n", quit_char);
+    printw("Type %s to quit\n\n", quit_name.c_str());
+    if (ioc_prefixes.size() > 1) {
+	std::stringstream ss;
+	for (size_t i = 0; i < ioc_prefixes.size(); i++) {
+	    ss << (i > 0 ? ", " : "") << ioc_prefixes[i];
+	}
+	printw("Targets (%zu): %s\n\n", ioc_prefixes.size(), ss.str().c_str());
+    }
     attron(A_ITALIC);
     attron(A_BOLD);
     printw("Keybindings:\n");
@@ -284,18 +869,365 @@ void show_keybindings(const toml::table &tbl) {
     attroff(A_BOLD);
     for (const auto &entry : *keybindings) {
 	std::stringstream ss;
-        auto entry_table = *entry.second.as_table();
 	ss << entry.first.str() << ": ";
-	if (entry_table["increment"]) {
-	    ss << entry_table["pv"] << " += ";
-	} else {
-	    ss << entry_table["pv"] << " = ";
-	}
-	if (entry_table["value"].value<float>().has_value()) {
-	    ss << entry_table["value"].value<float>().value() << std::endl;
+	show_puts(ss, entry.second);
+	if (auto key_char = to_binding_code(entry.first.str(), sequences)) {
+	    layout.rows[0][*key_char] = getcury(stdscr);
 	}
+	layout.column = std::max(layout.column, static_cast<int>(ss.str().length()) + 2);
+	ss << std::endl;
 	printw("%s",ss.str().c_str());
     }
+    // A layer lists only the bindings it adds or overrides, their readbacks
+    // are drawn there while it is active
+    if (auto layers_tbl = tbl["layers"].as_table()) {
+	for (const auto &[name, value] : *layers_tbl) {
+	    auto layer_tbl = value.as_table();
+	    std::map<int, int> &rows = layout.rows.emplace_back();
+	    printw("\nLayer %s (%s):\n", std::string(name.str()).c_str(),
+		   (*layer_tbl)["key"].value_or(std::string("?")).c_str());
+	    if (auto layer_bindings = (*layer_tbl)["keybindings"].as_table()) {
+		for (const auto &entry : *layer_bindings) {
+		    std::stringstream ss;
+		    ss << entry.first.str() << ": ";
+		    show_puts(ss, entry.second);
+		    if (auto key_char = to_binding_code(entry.first.str(), sequences)) {
+			rows[*key_char] = getcury(stdscr);
+		    }
+		    layout.column = std::max(layout.column, static_cast<int>(ss.str().length()) + 2);
+		    ss << std::endl;
+		    printw("%s", ss.str().c_str());
+		}
+	    }
+	}
+    }
+    return layout;
+}
+
+// Screen fields which change while the program runs
+struct ScreenFields {
+    Screen::FieldId queue_stats;
+    Screen::FieldId status;
+    std::vector<std::map<int, Screen::FieldId>> readbacks; // by layer, then by key code
+};
+
+// Returns the fields for the readbacks of each binding and the two bottom lines
+ScreenFields add_screen_fields(Screen &screen, const ReadbackLayout &layout) {
+    ScreenFields fields;
+    fields.queue_stats = screen.add_field(LINES - 2, 0);
+    fields.status = screen.add_field(LINES - 1, 0);
+    for (const auto &rows : layout.rows) {
+	std::map<int, Screen::FieldId> &readbacks = fields.readbacks.emplace_back();
+	for (const auto &[key_char, row] : rows) {
+	    readbacks[key_char] = screen.add_field(row, layout.column);
+	}
+    }
+    return fields;
+}
+
+// Returns the readback field of a key in a layer: its line in the layer if
+// the layer binds it, otherwise its line in the base layer, if any
+std::optional<Screen::FieldId> readback_field(const ScreenFields &fields, size_t layer, int key_char) {
+    for (const size_t l : {layer, size_t(0)}) {
+	if (l < fields.readbacks.size()) {
+	    if (auto it = fields.readbacks[l].find(key_char); it != fields.readbacks[l].end()) {
+		return it->second;
+	    }
+	}
+    }
+    return std::nullopt;
+}
+
+// Updates the readback fields of the active layer whose values changed since
+// they were last formatted. drawn holds the PVCache versions last formatted for each binding
+void update_readbacks(const Layer &layer, size_t layer_index, const ScreenFields &fields, Screen &screen,
+		      std::map<int, std::vector<uint64_t>> &drawn) {
+    for (const auto &[key_char, binding] : layer.bindings) {
+	const bool limited = std::any_of(binding.actions.begin(), binding.actions.end(),
+					 [](const auto &action) { return action.limits != nullptr; });
+	const std::optional<Screen::FieldId> field = readback_field(fields, layer_index, key_char);
+	if ((binding.readbacks.empty() and not limited) or not field) {
+	    continue;
+	}
+
+	std::vector<uint64_t> versions;
+	for (const auto &cache : binding.readbacks) {
+	    versions.push_back(cache->version());
+	}
+	for (const auto &action : binding.actions) {
+	    if (action.limits) {
+		versions.push_back(action.cache->version());
+		versions.push_back(action.limits->high->version());
+		versions.push_back(action.limits->low->version());
+	    }
+	}
+	if (drawn[key_char] == versions) {
+	    continue;
+	}
+	drawn[key_char] = versions;
+
+	std::stringstream ss;
+	for (size_t i = 0; i < binding.readbacks.size(); i++) {
+	    ss << (i > 0 ? " | " : "-> ") << binding.readbacks[i]->text().value_or("?");
+	}
+	// A binding pinned at a limit does nothing until it is moved away from it
+	for (const auto &action : binding.actions) {
+	    if (auto limit = pinned_limit(action)) {
+		ss << " [" << action.pv_name << " at limit " << *limit << "]";
+	    }
+	}
+	screen.set(*field, ss.str());
+    }
+}
+
+// Prints how long each startup phase took and how long each PV took to
+// connect, slowest first, from the spans recorded until startup_end
+void print_timing(std::ostream &out, tracing::Clock::time_point startup_end) {
+    std::vector<tracing::Event> phases;
+    std::vector<tracing::Event> connects;
+    for (const auto &event : tracing::events()) {
+	if (event.begin >= startup_end) {
+	    continue;
+	} else if (std::string(event.category) == "startup") {
+	    phases.push_back(event);
+	} else if (std::string(event.category) == "connect") {
+	    connects.push_back(event);
+	}
+    }
+    std::stable_sort(connects.begin(), connects.end(),
+		     [](const auto &a, const auto &b) { return a.duration > b.duration; });
+
+    auto ms = [](tracing::Clock::duration duration) {
+	return std::chrono::duration<double, std::milli>(duration).count();
+    };
+    out << "Startup timing:" << std::endl << std::fixed << std::setprecision(1);
+    for (const auto &event : phases) {
+	out << "  " << std::left << std::setw(16) << event.name << std::right << std::setw(10)
+	    << ms(event.duration) << " ms" << std::endl;
+    }
+    out << "PV connects (" << connects.size() << ", slowest first):" << std::endl;
+    for (const auto &event : connects) {
+	out << "  " << std::left << std::setw(30) << event.name << std::right << std::setw(10)
+	    << ms(event.duration) << " ms" << std::endl;
+    }
+}
+
+// Restores the values overwritten by the latest undo entry, as one batch of puts
+void undo_last(UndoStack &undo, int undo_key, PutScheduler &scheduler, StatusLine &status) {
+    std::optional<std::vector<PutAction>> restore = undo.pop();
+    if (not restore) {
+	status.set("Nothing to undo");
+	return;
+    }
+
+    std::stringstream ss;
+    ss << "Undone:";
+    for (auto &action : *restore) {
+	action.key = undo_key;
+	ss << " " << action.pv_name;
+    }
+    const std::string msg = ss.str();
+    const size_t total = restore->size();
+    auto barrier = std::make_shared<PutBarrier>([&status, msg, total](const auto &errors) {
+	status.set(errors.empty() ? msg : format_errors(errors, total));
+    });
+    for (const auto &action : *restore) {
+	scheduler.submit(action, barrier);
+    }
+    barrier->seal();
+}
+
+// Parses each keybinding of a section on its own, adding a message to errors
+// for every one which is invalid or uses a PV which did not connect
+void check_bindings(const toml::table &keybindings_tbl, const std::string &section, ChannelRegistry &registry,
+		    const std::vector<std::string> &ioc_prefixes, std::vector<std::string> &errors) {
+    KeyTrie sequences;
+    for (const auto &[key, value] : keybindings_tbl) {
+	const std::string where = section + "." + std::string(key.str()) + ": ";
+	std::vector<std::string> names;
+	const bool valid_key = to_key_codes(key, names).has_value();
+	if (not valid_key) {
+	    errors.push_back(where + "Invalid key");
+	}
+	std::vector<std::string> pv_names;
+	collect_pv_names(value, ioc_prefixes, pv_names);
+	std::string missing;
+	for (const auto &pv_name : pv_names) {
+	    if (not registry.contains(pv_name)) {
+		missing += (missing.empty() ? "" : ", ") + pv_name;
+	    }
+	}
+	if (not missing.empty()) {
+	    errors.push_back(where + "PV not connected: " + missing);
+	}
+	if (not valid_key or not missing.empty()) {
+	    continue;
+	}
+	try {
+	    toml::table single;
+	    single.insert(key, value);
+	    parse_bindings(single, registry, ioc_prefixes, sequences);
+	} catch (const std::exception &err) {
+	    errors.push_back(where + err.what());
+	}
+    }
+}
+
+// Returns every problem of a config: invalid key names, PVs which do not
+// connect, and values which do not match their PV's type. Every PV is
+// connected in one batch, so the whole check costs about one connect
+// timeout. Nothing is written to any PV
+std::vector<std::string> check_config(const toml::table &tbl, ChannelRegistry &registry,
+				      const std::vector<std::string> &ioc_prefixes) {
+    std::vector<std::string> errors;
+    for (const char *name : {"quit", "undo_key"}) {
+	if (auto key_name = tbl[name].value<std::string>(); key_name and not key_code(*key_name)) {
+	    errors.push_back(std::string(name) + ": Invalid key " + *key_name);
+	}
+    }
+
+    std::vector<std::string> pv_names;
+    for (const char *section : {"keybindings", "layers", "put"}) {
+	if (const toml::node *node = tbl.get(section)) {
+	    collect_pv_names(*node, ioc_prefixes, pv_names);
+	}
+    }
+    try {
+	registry.connect(pv_names);
+    } catch (const std::exception &err) {
+	errors.push_back(err.what());
+    }
+
+    if (auto put_array = tbl["put"].as_array()) {
+	for (size_t i = 0; i < put_array->size(); i++) {
+	    const std::string where = "put[" + std::to_string(i) + "]: ";
+	    auto table = (*put_array)[i].as_table();
+	    const std::optional<std::string> pv_name = table ? (*table)["pv"].value<std::string>() : std::nullopt;
+	    if (pv_name and std::any_of(ioc_prefixes.begin(), ioc_prefixes.end(), [&](const auto &prefix) {
+		return not registry.contains(prefix + *pv_name);
+	    })) {
+		errors.push_back(where + "PV not connected: " + *pv_name);
+		continue;
+	    }
+	    try {
+		if (not table) {
+		    throw std::runtime_error("Put list must only contain {pv=..., value=...} tables");
+		}
+		parse_action(*table, registry, ioc_prefixes);
+	    } catch (const std::exception &err) {
+		errors.push_back(where + err.what());
+	    }
+	}
+    }
+
+    auto keybindings_tbl = tbl["keybindings"].as_table();
+    if (!keybindings_tbl) {
+	errors.push_back("No keybindings section in TOML file");
+	return errors;
+    }
+    check_bindings(*keybindings_tbl, "keybindings", registry, ioc_prefixes, errors);
+    if (auto layers_tbl = tbl["layers"].as_table()) {
+	for (const auto &[name, value] : *layers_tbl) {
+	    const std::string section = "layers." + std::string(name.str());
+	    auto layer_tbl = value.as_table();
+	    if (!layer_tbl) {
+		errors.push_back(section + ": Layer must be a table");
+		continue;
+	    }
+	    if (not key_code((*layer_tbl)["key"].value_or(std::string()))) {
+		errors.push_back(section + ": Invalid or missing key");
+	    }
+	    if (auto layer_bindings = (*layer_tbl)["keybindings"].as_table()) {
+		check_bindings(*layer_bindings, section + ".keybindings", registry, ioc_prefixes, errors);
+	    }
+	}
+    }
+
+    // Conflicts between bindings, e.g. a layer key which is already bound,
+    // only show once every binding parses
+    if (errors.empty()) {
+	try {
+	    KeyTrie sequences;
+	    parse_keymap(tbl, registry, ioc_prefixes, sequences);
+	} catch (const std::exception &err) {
+	    errors.push_back(err.what());
+	}
+    }
+    return errors;
+}
+
+// Saves the value of every PV written by [keybindings], [layers.<name>] and
+// put in a config to a snapshot file. Readbacks are left out, they cannot be
+// written back. Returns the exit status
+int snapshot_command(const std::string &toml_path, const std::string &out_path, const std::string &cmdl_prefix,
+		     double timeout) {
+    if (toml_path.empty() or out_path.empty()) {
+	std::cerr << "Usage: pvkb snapshot <config.toml> -o <file>\n";
+	return 1;
+    }
+    try {
+	ConfigLoader loader;
+	toml::table tbl = loader.load(toml_path);
+	expand_all_templates(tbl);
+	const std::vector<std::string> ioc_prefixes = parse_prefixes(tbl, cmdl_prefix);
+	std::vector<std::string> pv_names;
+	for (const char *section : {"keybindings", "layers", "put"}) {
+	    if (const toml::node *node = tbl.get(section)) {
+		collect_pv_names(*node, ioc_prefixes, pv_names, false);
+	    }
+	}
+	std::sort(pv_names.begin(), pv_names.end());
+	pv_names.erase(std::unique(pv_names.begin(), pv_names.end()), pv_names.end());
+
+	const std::string provider_name = tbl["provider"].value_or(std::string("ca"));
+	epics::pvAccess::ca::CAClientFactory::start();
+	pvac::ClientProvider provider(provider_name);
+	std::vector<std::string> errors;
+	const Snapshot snapshot = take_snapshot(provider, provider_name, pv_names, timeout, errors);
+	save_snapshot(snapshot, out_path);
+
+	std::cout << "Saved " << snapshot.values.size() << " of " << pv_names.size() << " PVs to " << out_path << "\n";
+	for (const auto &error : errors) {
+	    std::cerr << "  " << error << "\n";
+	}
+	return errors.empty() ? 0 : 1;
+    } catch (const toml::parse_error& err) {
+	std::cerr << "Parsing failed:\n" << err << "\n";
+	return 1;
+    } catch (const std::exception &err) {
+	std::cerr << err.what() << std::endl;
+	return 1;
+    }
+}
+
+// Writes every value of a snapshot file back, with at most window puts in
+// flight. Returns the exit status
+int restore_command(const std::string &snap_path, size_t window, double timeout) {
+    if (snap_path.empty()) {
+	std::cerr << "Usage: pvkb restore <file>\n";
+	return 1;
+    }
+    try {
+	const Snapshot snapshot = load_snapshot(snap_path);
+	epics::pvAccess::ca::CAClientFactory::start();
+	pvac::ClientProvider provider(snapshot.provider);
+	const auto begin = std::chrono::steady_clock::now();
+	const std::vector<std::string> errors = execute_puts(restore_actions(snapshot, provider), timeout, window);
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+	std::cout << "Restored " << snapshot.values.size() - errors.size() << " of " << snapshot.values.size()
+		  << " PVs in " << std::fixed << std::setprecision(2) << elapsed.count() << "s\n";
+	for (const auto &error : errors) {
+	    std::cerr << "  " << error << "\n";
+	}
+	return errors.empty() ? 0 : 1;
+    } catch (const toml::parse_error& err) {
+	std::cerr << "Parsing failed:\n" << err << "\n";
+	return 1;
+    } catch (const std::exception &err) {
+	std::cerr << err.what() << std::endl;
+	return 1;
+    }
 }
 
 int main(int argc, char *argv[]) {
@@ -303,8 +1235,51 @@ int main(int argc, char *argv[]) {
     // Parse command line arguments
     // Command line args take precedence over config file
     argh::parser cmdl;
-    cmdl.add_params({"-p","--prefix"});
+    cmdl.add_params({"-p","--prefix","--trace","-o","--output","--window","--timeout"});
     cmdl.parse(argc, argv);
+
+    // --timing reports where startup time went, --trace out.json records
+    // every connect, get, put, and monitor event of the session
+    const bool show_timing = cmdl["--timing"];
+    const std::string trace_path = cmdl("--trace").str();
+    if (show_timing or not trace_path.empty()) {
+	tracing::enable();
+    }
+
+    // --list-keys prints every key name which can be bound
+    if (cmdl["--list-keys"]) {
+	for (const auto &entry : key_names()) {
+	    std::cout << "key_" << entry.name << "\n";
+	}
+	std::cout << "Any name may be preceded by ctrl_, alt_ and shift_, e.g. key_ctrl_alt_x" << std::endl;
+	return 0;
+    }
+
+    // 'pvkb log-dump <file>' prints an audit log as text
+    if (cmdl[1] == "log-dump") {
+	try {
+	    dump_audit_log(cmdl[2], std::cout);
+	} catch (const std::exception &err) {
+	    std::cerr << err.what() << std::endl;
+	    return 1;
+	}
+	return 0;
+    }
+
+    // 'pvkb snapshot <config> -o <file>' saves the value of every PV the
+    // config writes, 'pvkb restore <file>' writes them back
+    if (cmdl[1] == "snapshot") {
+	double timeout = 5.0;
+	cmdl("--timeout", timeout) >> timeout;
+	return snapshot_command(cmdl[2], cmdl({"-o","--output"}).str(), cmdl({"-p","--prefix"}).str(), timeout);
+    }
+    if (cmdl[1] == "restore") {
+	size_t window = 256;
+	double timeout = 10.0;
+	cmdl("--window", window) >> window;
+	cmdl("--timeout", timeout) >> timeout;
+	return restore_command(cmdl[2], window, timeout);
+    }
     
     // Path to TOML config file is first positional arg
     const std::string toml_path = cmdl[1];
@@ -313,64 +1288,361 @@ int main(int argc, char *argv[]) {
 	return 1;
     }
 
-    // Named argument for IOC prefix
-    std::string ioc_prefix = cmdl({"-p","--prefix"}).str();
+    // Named argument for IOC prefix, or a comma separated list of prefixes
+    const std::string cmdl_prefix = cmdl({"-p","--prefix"}).str();
     
-    // Parse the TOML config file into a toml::table
+    // Parse the TOML config file and the files it includes into a toml::table
+    ConfigLoader loader;
     toml::table tbl;
+    tracing::Clock::time_point phase = tracing::Clock::now();
     try {
-        tbl = toml::parse_file(toml_path);
+	tbl = loader.load(toml_path);
     } catch (const toml::parse_error& err) {
         std::cerr << "Parsing failed:\n" << err << "\n";
         return 1;
+    } catch (const std::exception &err) {
+	std::cerr << err.what() << std::endl;
+	return 1;
     }
 
-    // Get IOC prefix from config file if not overridden
-    if (ioc_prefix.empty()) {
-	ioc_prefix = tbl["prefix"].value_or("");
+    // Expand [[template]] sections into concrete keybindings
+    expand_all_templates(tbl);
+    tracing::span("startup", "parse config", phase);
+
+    // Get IOC prefixes from config file if not overridden
+    std::vector<std::string> ioc_prefixes = parse_prefixes(tbl, cmdl_prefix);
+
+    // --check reports every problem of the config at once and exits
+    // without writing to any PV or file
+    if (cmdl["--check"]) {
+	epics::pvAccess::ca::CAClientFactory::start();
+	pvac::ClientProvider provider(tbl["provider"].value_or(std::string("ca")));
+	ChannelRegistry registry(provider);
+	const std::vector<std::string> errors = check_config(tbl, registry, ioc_prefixes);
+	for (const auto &error : errors) {
+	    std::cerr << toml_path << ": " << error << "\n";
+	}
+	std::cout << toml_path << ": " << (errors.empty() ? "OK" : std::to_string(errors.size()) + " problems")
+		  << ", " << registry.size() << " PVs connected" << std::endl;
+	return errors.empty() ? 0 : 1;
     }
     
-    // Get character used to quit the program
-    const char quit_char = *tbl["quit"].value_or("q");
+    // Get key used to quit the program
+    int quit_key = parse_quit_key(tbl);
+
+    // Every completed put is recorded to audit_log, if set. Declared before
+    // the provider so it outlives every put callback
+    std::unique_ptr<AuditLog> audit_log;
+    if (auto audit_path = tbl["audit_log"].value<std::string>()) {
+	const int64_t max_mb = std::max(int64_t(1), tbl["audit_max_size"].value_or(int64_t(10)));
+	const int64_t files = std::max(int64_t(1), tbl["audit_files"].value_or(int64_t(5)));
+	audit_log = std::make_unique<AuditLog>(*audit_path, static_cast<size_t>(max_mb) << 20,
+					       static_cast<unsigned>(files));
+	AuditLog::install(audit_log.get());
+    }
+
+    // metrics = "9100", "127.0.0.1:9100" or "unix:/path" serves Prometheus metrics
+    std::unique_ptr<MetricsServer> metrics_server;
+    const std::optional<std::string> metrics_address = tbl["metrics"].is_integer()
+	? std::to_string(*tbl["metrics"].value<int64_t>()) : tbl["metrics"].value<std::string>();
+    if (metrics_address) {
+	try {
+	    metrics_server = std::make_unique<MetricsServer>(*metrics_address);
+	} catch (const std::exception &err) {
+	    std::cerr << err.what() << std::endl;
+	    return 1;
+	}
+    }
 
     // Get the provider "ca" or "pva", default: "ca"
+    phase = tracing::Clock::now();
     epics::pvAccess::ca::CAClientFactory::start();
     const std::optional<std::string> provider_name = tbl["provider"].value_or("ca");
     pvac::ClientProvider provider(provider_name.value());
 
+    // Channels are shared by every binding and kept across config reloads
+    ChannelRegistry registry(provider);
+    tracing::span("startup", "provider", phase);
+
     // Execute requested puts before running main loop
-    do_prelim_puts(tbl, provider, ioc_prefix);
+    phase = tracing::Clock::now();
+    do_prelim_puts(tbl, registry, ioc_prefixes);
+    tracing::span("startup", "prelim puts", phase);
     
     // Get the mapping key_char -> (pv channel, pv value, increment=true/false)
-    std::map<char, TupleVal> channel_map = parse_keybindings(tbl, provider, ioc_prefix);
+    phase = tracing::Clock::now();
+    BindingTable bindings;
+    auto sequences = std::make_shared<KeyTrie>();
+    bindings.store(parse_keymap(tbl, registry, ioc_prefixes, *sequences));
+    registry.retain(used_pv_names(*bindings.load()));
+    tracing::span("startup", "keybindings", phase);
+
+    // Index of the layer whose bindings the keys currently fire
+    size_t active_layer = 0;
+
+    // Key sequences are matched one keypress at a time on the input thread
+    SequenceMatcher matcher(std::chrono::milliseconds(std::max(1, tbl["sequence_timeout"].value_or(1000))));
+    matcher.reset(sequences);
+    std::optional<std::string> shown_partial;
     
     // Initialize ncurses
+    phase = tracing::Clock::now();
     initscr();
     keypad(stdscr, TRUE);
     noecho();
     start_color();
 
+    // Key release events need the kitty keyboard protocol, which we decode
+    // ourselves. Other terminals only report presses and auto-repeat
+    const bool want_release = tbl["key_release"].value_or(false);
+    const bool kitty_keyboard = want_release and enable_kitty_keyboard();
+    KittyDecoder decoder;
+    NcursesKeys ncurses_keys;
+
+    // input = "raw" reads the terminal directly instead of through getch().
+    // Split escape sequences wait escape_timeout ms for the rest either way
+    const std::string input_backend = tbl["input"].value_or("ncurses");
+    const auto escape_timeout = std::chrono::milliseconds(std::max(0, tbl["escape_timeout"].value_or(25)));
+    std::unique_ptr<RawInput> raw_input;
+    if (input_backend == "raw") {
+	raw_input = std::make_unique<RawInput>(STDIN_FILENO, escape_timeout, kitty_keyboard);
+    } else if (input_backend == "ncurses") {
+	set_escdelay(static_cast<int>(escape_timeout.count()));
+    } else {
+	endwin();
+	std::cerr << "Invalid input '" << input_backend << "', expected \"ncurses\" or \"raw\"" << std::endl;
+	return 1;
+    }
+
     // Print out active keybindings
-    show_keybindings(tbl);
+    ReadbackLayout layout = show_keybindings(tbl, ioc_prefixes, *sequences);
+    const tracing::Clock::time_point startup_end = tracing::Clock::now();
+    tracing::span("startup", "ncurses init", phase, startup_end);
 
-    // Listen for keypresses and execute requested puts
+    // Readbacks and put results change in the background. The screen is
+    // redrawn at most max_fps times per second no matter how fast they change
+    int max_fps = std::max(1, tbl["max_fps"].value_or(10));
+    auto frame_interval = std::chrono::milliseconds(1000 / max_fps);
+    auto last_frame = std::chrono::steady_clock::time_point();
+    std::map<int, std::vector<uint64_t>> drawn_readbacks;
+    timeout(static_cast<int>(frame_interval.count()));
+
+    // Only cells that changed are redrawn
+    auto screen = std::make_unique<Screen>();
+    ScreenFields fields = add_screen_fields(*screen, layout);
+    size_t frames = 0;
+    size_t cells_written = 0;
+
+    // The config file is reloaded whenever it or a file it includes is saved
+    auto watcher = std::make_unique<FileWatcher>(loader.files());
+    bool reload_pending = false;
+
+    // Latency of urgent bindings is tracked separately from everything else
+    LatencyStats latency;
+    LatencyStats urgent_latency;
+    StatusLine status;
+    PutScheduler scheduler;
+    // undo_key restores the values the latest binding overwrote. Rapid
+    // changes to the same PVs within undo_merge seconds are one entry
+    std::optional<int> undo_key = parse_undo_key(tbl);
+    UndoStack undo(static_cast<size_t>(std::max(int64_t(1), tbl["undo_depth"].value_or(int64_t(32)))),
+		   std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		       std::chrono::duration<double>(tbl["undo_merge"].value_or(1.0))));
+    KeyDispatcher dispatcher(bindings, scheduler, latency, status, &undo);
+    // A reload in progress. Declared after the registry, so exiting waits for it
+    std::future<Reload> reloading;
+    if (want_release and not kitty_keyboard) {
+	status.set("Terminal does not report key release, holds end after hold_gap");
+    }
+
+    // Listen for keypresses and hand them to the dispatch thread.
+    // Urgent bindings skip the key queue and are submitted right here
     while (true) {
-	int ch = getch();
-	if (ch == quit_char) {
+	std::vector<KeyInput> inputs;
+	if (raw_input) {
+	    inputs = raw_input->read(frame_interval);
+	} else if (int ch = getch(); ch != ERR) {
+	    const int timeout_ms = static_cast<int>(frame_interval.count());
+	    if (auto input = kitty_keyboard ? decoder.feed(ch) : KeyInput{ncurses_keys.translate(ch, timeout_ms)}) {
+		inputs.push_back(*input);
+	    }
+	}
+	metrics::input_events(inputs.size());
+
+	// Fires the binding of a key or completed key sequence
+	const std::shared_ptr<const Keymap> keymap = bindings.load();
+	auto fire = [&](int key_char, KeyEventType type) {
+	    const Binding *binding = keymap->find(active_layer, key_char);
+	    if (binding == nullptr) {
+		return;
+	    }
+	    if (binding->urgent and not binding->hold) {
+		if (type != KeyEventType::release) {
+		    dispatcher.supersede(*binding);
+		    dispatch_binding(*binding, std::chrono::steady_clock::now(), scheduler, urgent_latency, status, &undo);
+		}
+	    } else if (not dispatcher.post(key_char, type, active_layer)) {
+		status.set("Key queue full, keypress dropped");
+	    }
+	};
+
+	// Presses advance the sequence matcher, repeats and releases
+	// only matter to hold bindings, which are always single keys
+	bool quit = false;
+	const auto pressed = std::chrono::steady_clock::now();
+	for (const auto &input : inputs) {
+	    if (input.key == quit_key and input.type == KeyEventType::press) {
+		quit = true;
+		break;
+	    }
+	    if (input.key == undo_key and input.type == KeyEventType::press) {
+		undo_last(undo, input.key, scheduler, status);
+		continue;
+	    }
+	    if (input.type == KeyEventType::press) {
+		// A layer key switches to its layer, or back to the base layer
+		if (auto layer = keymap->layer_of(input.key)) {
+		    active_layer = (active_layer == *layer ? 0 : *layer);
+		    status.set("Layer: " + keymap->layers[active_layer]->name);
+		    for (const auto &readbacks : fields.readbacks) {
+			for (const auto &[key_char, field] : readbacks) {
+			    screen->set(field, "");
+			}
+		    }
+		    drawn_readbacks.clear();
+		    continue;
+		}
+		for (int key_char : matcher.feed(input.key, pressed)) {
+		    fire(key_char, KeyEventType::press);
+		}
+	    } else {
+		fire(input.key, input.type);
+	    }
+	}
+	if (quit) {
 	    break;
 	}
+	if (auto key_char = matcher.expire(pressed)) {
+	    fire(*key_char, KeyEventType::press);
+	}
+	if (auto partial = matcher.partial(); partial != shown_partial) {
+	    status.set(partial ? *partial + " ..." : "");
+	    shown_partial = partial;
+	}
 
-	if (channel_map.count(ch) > 0) {
-	    const TupleVal key_tuple = channel_map.at(ch);
-	    pvac::ClientChannel channel = std::get<0>(key_tuple);
-	    const TargetVar val = std::get<1>(key_tuple);
-	    const bool increment = std::get<2>(key_tuple);
-	    execute_put(channel, val, increment);
+	const auto now = std::chrono::steady_clock::now();
+	if (now - last_frame < frame_interval) {
+	    continue;
+	}
+	last_frame = now;
+
+	// The config is parsed and its channels connected on a worker thread,
+	// so keys keep working meanwhile. The new bindings are swapped in only
+	// once the whole file parsed and every channel connected, otherwise the
+	// old bindings stay active. Channels used by both are reused as is.
+	// A file saved while a reload runs starts another one after it
+	reload_pending = watcher->changed() or reload_pending;
+	if (not reloading.valid() and reload_pending) {
+	    reload_pending = false;
+	    reloading = std::async(std::launch::async, reload_config, std::ref(loader), std::ref(registry),
+				   toml_path, cmdl_prefix);
+	} else if (reloading.valid() and reloading.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+	    bool reloaded = false;
+	    try {
+		Reload reload = reloading.get();
+		bindings.store(reload.keymap);
+		sequences = reload.sequences;
+		matcher.reset(sequences);
+		active_layer = 0;
+		const size_t disconnected = registry.retain(used_pv_names(*reload.keymap));
+
+		tbl = std::move(reload.tbl);
+		ioc_prefixes = std::move(reload.ioc_prefixes);
+		quit_key = parse_quit_key(tbl);
+		undo_key = parse_undo_key(tbl);
+		max_fps = std::max(1, tbl["max_fps"].value_or(10));
+		frame_interval = std::chrono::milliseconds(1000 / max_fps);
+		timeout(static_cast<int>(frame_interval.count()));
+
+		frames += screen->frames();
+		cells_written += screen->cells_written();
+		clear();
+		layout = show_keybindings(tbl, ioc_prefixes, *sequences);
+		screen = std::make_unique<Screen>();
+		fields = add_screen_fields(*screen, layout);
+		drawn_readbacks.clear();
+		reloaded = true;
+
+		std::stringstream ss;
+		ss << "Reloaded: " << reload.connected << " PVs connected, " << disconnected << " disconnected, "
+		   << loader.parsed() << " of " << loader.files().size() << " files parsed";
+		status.set(ss.str());
+	    } catch (const toml::parse_error &err) {
+		std::stringstream ss;
+		ss << "Reload failed: " << err.description() << " (" << (err.source().path ? *err.source().path : toml_path)
+		   << ":" << err.source().begin.line << ")";
+		status.set(ss.str());
+	    } catch (const std::exception &err) {
+		status.set(std::string("Reload failed: ") + err.what());
+	    }
+	    // Channels connected for a config which failed stay only if the active bindings use them
+	    if (not reloaded) {
+		registry.retain(used_pv_names(*bindings.load()));
+	    }
+	    // Watch the files the reload read, a failed one included so saving a fix
+	    // is noticed. Whatever was saved after the reload read a file is caught
+	    // by its modification time, as the new watcher cannot have seen it
+	    watcher = std::make_unique<FileWatcher>(loader.files());
+	    reload_pending = reload_pending or loader.stale();
 	}
 
-	refresh();
+	screen->set(fields.queue_stats, format_queue_stats(dispatcher));
+	if (auto msg = status.take()) {
+	    screen->set(fields.status, *msg);
+	}
+	update_readbacks(*bindings.load()->layers[active_layer], active_layer, fields, *screen, drawn_readbacks);
+	screen->flush();
+    }
+    const size_t raw_input_events = raw_input ? raw_input->events() : 0;
+    const double raw_input_ns = raw_input ? raw_input->decode_ns_per_event() : 0.0;
+    raw_input.reset();
+    if (kitty_keyboard) {
+	disable_kitty_keyboard();
     }
     endwin();
+    frames += screen->frames();
+    cells_written += screen->cells_written();
+
+    std::cout << "Put latency: " << latency.summary() << std::endl;
+    std::cout << "Urgent put latency: " << urgent_latency.summary() << std::endl;
+    if (frames > 0) {
+	std::cout << "Screen: " << frames << " frames, "
+		  << cells_written / frames << " cells per frame on average" << std::endl;
+    }
+    if (raw_input_events > 0) {
+	std::cout << "Input decode: " << raw_input_events << " keys, " << std::fixed << std::setprecision(0)
+		  << raw_input_ns << " ns per key" << std::endl;
+    }
+    std::cout << "Key queue high-water: " << dispatcher.high_water() << "/" << KeyDispatcher::queue_capacity
+	      << ", dropped: " << dispatcher.dropped() << std::endl;
+    if (audit_log) {
+	std::cout << "Audit log: " << audit_log->written() << " puts written, "
+		  << audit_log->dropped() << " dropped" << std::endl;
+    }
+    if (show_timing) {
+	print_timing(std::cout, startup_end);
+    }
+    if (not trace_path.empty()) {
+	if (tracing::write(trace_path)) {
+	    std::cout << "Trace: " << tracing::events().size() << " events written to " << trace_path;
+	    if (tracing::dropped() > 0) {
+		std::cout << ", " << tracing::dropped() << " dropped";
+	    }
+	    std::cout << std::endl;
+	} else {
+	    std::cerr << "Failed to write trace to " << trace_path << std::endl;
+	}
+    }
 
     return 0;
 }
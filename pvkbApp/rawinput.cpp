@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <string_view>
+
+#include <ncurses.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "keynames.h"
+#include "rawinput.h"
+
+namespace {
+
+struct EscapeSequence {
+    std::string_view seq;
+    int key;
+};
+
+// Sequences sent by xterm compatible terminals in normal and application
+// cursor mode, with the ncurses key codes getch() returns for them
+const std::array<EscapeSequence, 37> escape_table = {{
+    {"\x1b[A", KEY_UP}, {"\x1b[B", KEY_DOWN}, {"\x1b[C", KEY_RIGHT}, {"\x1b[D", KEY_LEFT},
+    {"\x1bOA", KEY_UP}, {"\x1bOB", KEY_DOWN}, {"\x1bOC", KEY_RIGHT}, {"\x1bOD", KEY_LEFT},
+    {"\x1b[H", KEY_HOME}, {"\x1b[F", KEY_END}, {"\x1bOH", KEY_HOME}, {"\x1bOF", KEY_END},
+    {"\x1b[1~", KEY_HOME}, {"\x1b[4~", KEY_END}, {"\x1b[7~", KEY_HOME}, {"\x1b[8~", KEY_END},
+    {"\x1b[2~", KEY_IC}, {"\x1b[3~", KEY_DC}, {"\x1b[5~", KEY_PPAGE}, {"\x1b[6~", KEY_NPAGE},
+    {"\x1bOP", KEY_F(1)}, {"\x1bOQ", KEY_F(2)}, {"\x1bOR", KEY_F(3)}, {"\x1bOS", KEY_F(4)},
+    {"\x1b[15~", KEY_F(5)}, {"\x1b[17~", KEY_F(6)}, {"\x1b[18~", KEY_F(7)}, {"\x1b[19~", KEY_F(8)},
+    {"\x1b[20~", KEY_F(9)}, {"\x1b[21~", KEY_F(10)}, {"\x1b[23~", KEY_F(11)}, {"\x1b[24~", KEY_F(12)},
+    {"\x1b[P", KEY_F(1)}, {"\x1b[Q", KEY_F(2)}, {"\x1b[S", KEY_F(4)},
+    {"\x1b[Z", KEY_BTAB}, {"\x1bOM", '\n'},
+}};
+
+// Returns the key getch() would report for a plain byte
+int plain_key(unsigned char byte) {
+    if (byte == '\r') {
+	return '\n';
+    } else if (byte == 0x7f or byte == '\b') {
+	return KEY_BACKSPACE;
+    }
+    return byte;
+}
+
+} // namespace
+
+void EscapeDecoder::feed(const char *data, size_t n, std::vector<KeyInput> &out) {
+    for (size_t i = 0; i < n; i++) {
+	const char byte = data[i];
+	if (pending_.empty() and byte != 0x1b) {
+	    out.push_back(KeyInput{plain_key(byte)});
+	    continue;
+	}
+	pending_ += byte;
+	decode_pending(out);
+    }
+}
+
+void EscapeDecoder::flush(std::vector<KeyInput> &out) {
+    if (pending_ == "\x1b") {
+	out.push_back(KeyInput{0x1b});
+    }
+    pending_.clear();
+}
+
+void EscapeDecoder::decode_pending(std::vector<KeyInput> &out) {
+    if (pending_.size() < 2) {
+	return;
+    }
+
+    // ESC followed by anything other than '[' or 'O' is alt+key
+    const char kind = pending_[1];
+    if (kind != '[' and kind != 'O') {
+	const unsigned char byte = pending_[1];
+	pending_.clear();
+	out.push_back(KeyInput{apply_modifiers(plain_key(byte), modifier_alt)});
+	return;
+    }
+
+    // SS3 sequences are one byte long, CSI sequences end with a final byte
+    const unsigned char last = pending_.back();
+    const bool complete = kind == 'O' ? pending_.size() == 3
+				      : pending_.size() > 2 and last >= 0x40 and last <= 0x7e;
+    if (not complete) {
+	if (pending_.size() > 32) {
+	    pending_.clear();
+	}
+	return;
+    }
+
+    // Modified keys carry the modifiers as a second parameter, e.g.
+    // "\e[1;5A" is ctrl+up and "\e[3;2~" shift+delete. They are looked up
+    // without it, as "\e[A" and "\e[3~"
+    std::string seq = pending_;
+    int modifiers = 0;
+    if (const size_t semicolon = seq.find(';'); kind == '[' and semicolon != std::string::npos) {
+	const std::string first = seq.substr(2, semicolon - 2);
+	modifiers = std::atoi(seq.c_str() + semicolon + 1) - 1;
+	seq = "\x1b[" + (first == "1" and last != '~' ? std::string() : first) + static_cast<char>(last);
+    }
+
+    auto it = std::find_if(escape_table.begin(), escape_table.end(),
+			   [&seq](const EscapeSequence &entry) { return entry.seq == seq; });
+    if (it != escape_table.end()) {
+	out.push_back(KeyInput{apply_modifiers(it->key, std::max(0, modifiers) & 7)});
+    }
+    pending_.clear();
+}
+
+RawInput::RawInput(int fd, std::chrono::milliseconds escape_timeout, bool kitty)
+    : fd_(fd), escape_timeout_(escape_timeout), kitty_(kitty) {
+    termios attrs;
+    if (tcgetattr(fd_, &attrs) != 0) {
+	return;
+    }
+    saved_ = attrs;
+
+    // Raw mode, but leave ISIG on so Ctrl-C still stops the program and
+    // leave output processing alone since ncurses relies on it
+    attrs.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    attrs.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN);
+    attrs.c_cflag |= CS8;
+    attrs.c_cc[VMIN] = 0;
+    attrs.c_cc[VTIME] = 0;
+    tcsetattr(fd_, TCSANOW, &attrs);
+}
+
+RawInput::~RawInput() {
+    if (saved_) {
+	tcsetattr(fd_, TCSANOW, &*saved_);
+    }
+}
+
+std::vector<KeyInput> RawInput::read(std::chrono::milliseconds timeout) {
+    std::vector<KeyInput> keys;
+
+    // A pending escape only waits until its own timeout runs out
+    const bool escape_pending = not kitty_ and escape_decoder_.pending();
+    if (escape_pending) {
+	const auto waited = std::chrono::steady_clock::now() - escape_started_;
+	timeout = std::min(timeout, std::max(std::chrono::milliseconds(0),
+					     escape_timeout_ - std::chrono::duration_cast<std::chrono::milliseconds>(waited)));
+    }
+
+    pollfd pfd{fd_, POLLIN, 0};
+    if (poll(&pfd, 1, static_cast<int>(timeout.count())) <= 0) {
+	if (escape_pending and std::chrono::steady_clock::now() - escape_started_ >= escape_timeout_) {
+	    escape_decoder_.flush(keys);
+	    events_ += keys.size();
+	}
+	return keys;
+    }
+
+    char buf[256];
+    const ssize_t n = ::read(fd_, buf, sizeof(buf));
+    if (n <= 0) {
+	return keys;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    if (kitty_) {
+	for (ssize_t i = 0; i < n; i++) {
+	    if (auto key = kitty_decoder_.feed(static_cast<unsigned char>(buf[i]))) {
+		keys.push_back(*key);
+	    }
+	}
+    } else {
+	escape_decoder_.feed(buf, static_cast<size_t>(n), keys);
+	if (not escape_pending and escape_decoder_.pending()) {
+	    escape_started_ = start;
+	}
+    }
+    decode_time_ += std::chrono::steady_clock::now() - start;
+    events_ += keys.size();
+    return keys;
+}
+
+double RawInput::decode_ns_per_event() const {
+    if (events_ == 0) {
+	return 0.0;
+    }
+    return std::chrono::duration<double, std::nano>(decode_time_).count() / events_;
+}
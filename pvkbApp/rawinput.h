@@ -0,0 +1,74 @@
+#ifndef PVKB_RAWINPUT_H
+#define PVKB_RAWINPUT_H
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <termios.h>
+
+#include "keyproto.h"
+
+// Decodes legacy (xterm/VT100) escape sequences into ncurses key codes
+// using a fixed table, e.g. "\e[A" and "\eOA" are both KEY_UP.
+// CSI and SS3 sequences which are not in the table are dropped whole, so
+// an unknown key never turns into a burst of stray characters.
+class EscapeDecoder {
+  public:
+    // Decodes a burst of bytes, appending complete keys to out. A trailing
+    // incomplete sequence is kept until more bytes arrive or flush() is called
+    void feed(const char *data, size_t n, std::vector<KeyInput> &out);
+
+    // Gives up on a pending escape once the escape timeout has passed,
+    // a lone escape is then reported as the escape key
+    void flush(std::vector<KeyInput> &out);
+
+    // Returns true while part of an escape sequence is waiting for more bytes
+    bool pending() const { return not pending_.empty(); }
+
+  private:
+    // Decodes pending_ if it is a complete sequence
+    void decode_pending(std::vector<KeyInput> &out);
+
+    std::string pending_;
+};
+
+// Reads the keyboard straight from the terminal instead of through getch(),
+// so every burst of bytes is decoded as soon as it arrives. Escape
+// sequences only wait for escape_timeout, instead of ncurses' ESCDELAY,
+// when they arrive split across reads. The terminal is put in raw mode,
+// except that signals like Ctrl-C still work, and restored on destruction.
+class RawInput {
+  public:
+    // kitty selects the kitty keyboard protocol decoder, see enable_kitty_keyboard()
+    RawInput(int fd, std::chrono::milliseconds escape_timeout, bool kitty);
+    ~RawInput();
+
+    RawInput(const RawInput &) = delete;
+    RawInput &operator=(const RawInput &) = delete;
+
+    // Waits up to timeout for input and returns the keys decoded from it
+    std::vector<KeyInput> read(std::chrono::milliseconds timeout);
+
+    // Returns the number of keys decoded so far
+    size_t events() const { return events_; }
+
+    // Returns the mean time spent decoding each key, in nanoseconds
+    double decode_ns_per_event() const;
+
+  private:
+    int fd_;
+    std::optional<termios> saved_;
+    std::chrono::milliseconds escape_timeout_;
+    bool kitty_;
+    KittyDecoder kitty_decoder_;
+    EscapeDecoder escape_decoder_;
+    std::chrono::steady_clock::time_point escape_started_;
+
+    size_t events_ = 0;
+    std::chrono::steady_clock::duration decode_time_{0};
+};
+
+#endif
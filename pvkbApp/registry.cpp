@@ -0,0 +1,128 @@
+#include <stdexcept>
+
+#include <pv/pvData.h>
+
+#include "registry.h"
+#include "trace.h"
+#include "metrics.h"
+
+// Returns the key of a cache in an Entry, equal options share one monitor
+static std::string options_key(const MonitorOptions &options) {
+    return std::to_string(options.deadband) + (options.deadband_percent ? "%" : "")
+	+ "/" + std::to_string(options.queue_size);
+}
+
+GetBatch::GetBatch(std::vector<pvac::ClientChannel> &channels)
+    : remaining_(channels.size()), events_(channels.size()), completed_(channels.size()) {
+    for (size_t i = 0; i < channels.size(); i++) {
+	requests_.push_back(std::make_unique<Request>(*this, i));
+    }
+    for (size_t i = 0; i < channels.size(); i++) {
+	requests_[i]->op = channels[i].get(requests_[i].get());
+    }
+}
+
+GetBatch::~GetBatch() {
+    for (auto &request : requests_) {
+	request->op.cancel();
+    }
+}
+
+void GetBatch::wait(double timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, std::chrono::duration<double>(timeout), [this] { return remaining_ == 0; });
+}
+
+std::optional<pvac::GetEvent> GetBatch::event(size_t i) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_[i];
+}
+
+std::chrono::steady_clock::time_point GetBatch::completed(size_t i) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_[i] ? completed_[i] : std::chrono::steady_clock::now();
+}
+
+void GetBatch::done(size_t i, const pvac::GetEvent &evt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not events_[i]) {
+	events_[i] = evt;
+	completed_[i] = std::chrono::steady_clock::now();
+	remaining_--;
+    }
+    if (remaining_ == 0) {
+	cv_.notify_all();
+    }
+}
+
+ChannelRegistry::ChannelRegistry(pvac::ClientProvider &provider) : provider_(provider) {}
+
+size_t ChannelRegistry::connect(const std::vector<std::string> &pv_names) {
+    const tracing::Clock::time_point begin = tracing::Clock::now();
+    std::set<std::string> seen;
+    std::vector<std::string> pending;
+    std::vector<pvac::ClientChannel> channels;
+    for (const auto &pv_name : pv_names) {
+	if (entries_.count(pv_name) == 0 and seen.insert(pv_name).second) {
+	    pending.push_back(pv_name);
+	    channels.push_back(provider_.connect(pv_name));
+	}
+    }
+    GetBatch batch(channels);
+    batch.wait(3.0);
+
+    std::string failed;
+    for (size_t i = 0; i < pending.size(); i++) {
+	const std::optional<pvac::GetEvent> evt = batch.event(i);
+	// Keep the type name of the value field, e.g. "double" or "enum_t"
+	epics::pvData::FieldConstPtr value;
+	if (evt and evt->event == pvac::GetEvent::Success and evt->value) {
+	    value = evt->value->getStructure()->getField("value");
+	}
+	if (value) {
+	    entries_[pending[i]] = Entry{channels[i], value->getID(), {}};
+	    metrics::channel_connected();
+	} else {
+	    failed += (failed.empty() ? "" : ", ") + pending[i];
+	}
+	// Every connect started at begin, so each span ends when its PV answered
+	tracing::span("connect", pending[i], begin, batch.completed(i));
+    }
+    if (not failed.empty()) {
+	throw std::runtime_error("Failed to connect to PV " + failed);
+    }
+    return pending.size();
+}
+
+pvac::ClientChannel ChannelRegistry::channel(const std::string &pv_name) const {
+    return entries_.at(pv_name).channel;
+}
+
+std::string ChannelRegistry::pv_type(const std::string &pv_name) const {
+    return entries_.at(pv_name).pv_type;
+}
+
+std::shared_ptr<PVCache> ChannelRegistry::cache(const std::string &pv_name, const MonitorOptions &options) {
+    Entry &entry = entries_.at(pv_name);
+    std::shared_ptr<PVCache> &cache = entry.caches[options_key(options)];
+    if (not cache) {
+	cache = std::make_shared<PVCache>(entry.channel, options);
+    }
+    return cache;
+}
+
+size_t ChannelRegistry::retain(const std::set<std::string> &pv_names) {
+    size_t dropped = 0;
+    for (auto it = entries_.begin(); it != entries_.end();) {
+	if (pv_names.count(it->first) > 0) {
+	    ++it;
+	    continue;
+	}
+	// The provider forgets the channel, which closes once the last binding
+	// still holding it (e.g. an in-flight put) lets go
+	provider_.disconnect(it->first);
+	it = entries_.erase(it);
+	dropped++;
+    }
+    return dropped;
+}
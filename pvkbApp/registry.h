@@ -0,0 +1,110 @@
+#ifndef PVKB_REGISTRY_H
+#define PVKB_REGISTRY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <pva/client.h>
+
+#include "pvcache.h"
+
+// Gets of many channels in flight at once, so N PVs cost about one round
+// trip, or one timeout, rather than N. A get waits for its channel to
+// connect, and completes on a pvAccess worker thread
+class GetBatch {
+  public:
+    // Starts a get of every channel
+    explicit GetBatch(std::vector<pvac::ClientChannel> &channels);
+
+    // Cancels the gets still outstanding, none reports afterwards
+    ~GetBatch();
+
+    GetBatch(const GetBatch &) = delete;
+    GetBatch &operator=(const GetBatch &) = delete;
+
+    // Waits until every get completed or timeout seconds passed
+    void wait(double timeout);
+
+    // Returns the result of the get of channels[i], or nullopt if it has not completed
+    std::optional<pvac::GetEvent> event(size_t i) const;
+
+    // Returns when the get of channels[i] completed, or now if it has not
+    std::chrono::steady_clock::time_point completed(size_t i) const;
+
+  private:
+    struct Request : public pvac::ClientChannel::GetCallback {
+	Request(GetBatch &batch, size_t index) : batch(batch), index(index) {}
+	void getDone(const pvac::GetEvent &evt) override { batch.done(index, evt); }
+
+	GetBatch &batch;
+	const size_t index;
+	pvac::Operation op;
+    };
+
+    void done(size_t i, const pvac::GetEvent &evt);
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t remaining_ = 0;
+    std::vector<std::optional<pvac::GetEvent>> events_;
+    std::vector<std::chrono::steady_clock::time_point> completed_;
+    std::vector<std::unique_ptr<Request>> requests_;
+};
+
+// Channels, PV types, and monitors used by the keybindings. Everything is
+// keyed by PV name and kept across config reloads, so a reload only
+// connects the PVs which are new and disconnects the ones no longer used.
+class ChannelRegistry {
+  public:
+    explicit ChannelRegistry(pvac::ClientProvider &provider);
+
+    ChannelRegistry(const ChannelRegistry &) = delete;
+    ChannelRegistry &operator=(const ChannelRegistry &) = delete;
+
+    // Connects the PVs which are not connected yet. All connects, and the
+    // gets which learn each PV's type, are started before waiting on any of
+    // them, so N PVs cost about one timeout rather than N. Throws naming
+    // every PV which failed, the others stay connected. Returns the number
+    // connected. Each PV is traced as a "connect" span
+    size_t connect(const std::vector<std::string> &pv_names);
+
+    // Returns true if a PV passed to connect() is connected
+    bool contains(const std::string &pv_name) const { return entries_.count(pv_name) > 0; }
+
+    // Returns the channel of a PV passed to connect()
+    pvac::ClientChannel channel(const std::string &pv_name) const;
+
+    // Returns the type name of the value field of a PV passed to connect(),
+    // e.g. "double", "enum_t", or "double[]"
+    std::string pv_type(const std::string &pv_name) const;
+
+    // Returns the monitor cache of a PV passed to connect(), one is
+    // created the first time a PV is asked for with given options
+    std::shared_ptr<PVCache> cache(const std::string &pv_name, const MonitorOptions &options = MonitorOptions());
+
+    // Drops every channel and monitor whose PV is not in pv_names.
+    // Returns the number of PVs disconnected
+    size_t retain(const std::set<std::string> &pv_names);
+
+    // Returns the number of connected PVs
+    size_t size() const { return entries_.size(); }
+
+  private:
+    struct Entry {
+	pvac::ClientChannel channel;
+	std::string pv_type;
+	std::map<std::string, std::shared_ptr<PVCache>> caches; // by monitor options
+    };
+
+    pvac::ClientProvider &provider_;
+    std::map<std::string, Entry> entries_;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include <algorithm>
+
+#include <ncurses.h>
+
+#include "render.h"
+
+Screen::FieldId Screen::add_field(int row, int col, int width) {
+    fields_.push_back(Field{row, col, width, "", "", false});
+    return fields_.size() - 1;
+}
+
+void Screen::set(FieldId id, const std::string &text) {
+    Field &field = fields_.at(id);
+    const int width = field.width > 0 ? field.width : std::max(0, COLS - field.col);
+    std::string clipped = text.substr(0, width);
+
+    if (clipped == field.text) {
+	return;
+    }
+    field.text = std::move(clipped);
+    if (not field.dirty) {
+	field.dirty = true;
+	dirty_.push_back(id);
+    }
+}
+
+size_t Screen::flush() {
+    size_t cells = 0;
+    for (const FieldId id : dirty_) {
+	Field &field = fields_[id];
+	field.dirty = false;
+
+	// Pad with blanks so leftovers of a longer old text get erased
+	std::string wanted = field.text;
+	wanted.resize(std::max(wanted.length(), field.drawn.length()), ' ');
+	std::string drawn = field.drawn;
+	drawn.resize(wanted.length(), ' ');
+
+	// Only the span between the first and last differing cell is written
+	size_t first = 0;
+	while (first < wanted.length() and wanted[first] == drawn[first]) {
+	    first++;
+	}
+	if (first == wanted.length()) {
+	    continue;
+	}
+	size_t last = wanted.length() - 1;
+	while (wanted[last] == drawn[last]) {
+	    last--;
+	}
+
+	const int count = static_cast<int>(last - first + 1);
+	mvaddnstr(field.row, field.col + static_cast<int>(first), wanted.c_str() + first, count);
+	cells += count;
+	field.drawn = field.text;
+    }
+    dirty_.clear();
+
+    if (cells > 0) {
+	wnoutrefresh(stdscr);
+	doupdate();
+	frames_++;
+	cells_written_ += cells;
+    }
+    return cells;
+}
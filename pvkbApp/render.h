@@ -0,0 +1,48 @@
+#ifndef PVKB_RENDER_H
+#define PVKB_RENDER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Thin layer over ncurses for the parts of the screen which change while
+// pvkb runs: readbacks, the status line, and the key queue metrics.
+// Each field remembers what is currently on the terminal, and flush() only
+// rewrites the span of cells that differ, so a frame where one digit of one
+// readback changed costs one character of terminal output.
+class Screen {
+  public:
+    using FieldId = size_t;
+
+    // Adds a text field at the given position, width 0 extends to the
+    // right edge of the terminal. Returns the id used with set()
+    FieldId add_field(int row, int col, int width = 0);
+
+    // Changes the text of a field, nothing is drawn until flush()
+    void set(FieldId field, const std::string &text);
+
+    // Draws the changed cells of every changed field and updates the terminal.
+    // Returns the number of cells written
+    size_t flush();
+
+    // Totals since startup, to judge the cost of a frame
+    size_t frames() const { return frames_; }
+    size_t cells_written() const { return cells_written_; }
+
+  private:
+    struct Field {
+	int row;
+	int col;
+	int width;
+	std::string text;  // wanted on screen
+	std::string drawn; // currently on screen
+	bool dirty = false;
+    };
+
+    std::vector<Field> fields_;
+    std::vector<FieldId> dirty_;
+    size_t frames_ = 0;
+    size_t cells_written_ = 0;
+};
+
+#endif
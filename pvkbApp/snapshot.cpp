@@ -0,0 +1,178 @@
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+
+#include <pv/pvData.h>
+
+#include "toml++/toml.hpp"
+#include "registry.h"
+#include "snapshot.h"
+
+// Returns the value field of a get in the type the PV takes, or nullopt
+// if it cannot be written back, e.g. an array of strings
+static std::optional<TargetVar> value_of(const epics::pvData::PVStructure &root, const std::string &pv_type) {
+    if (pv_type == "enum_t") {
+	return root.getSubFieldT<epics::pvData::PVScalar>("value.index")->getAs<int>();
+    }
+    if (is_array_type(pv_type)) {
+	epics::pvData::shared_vector<const double> arr;
+	root.getSubFieldT<epics::pvData::PVScalarArray>("value")->getAs<double>(arr);
+	return std::vector<double>(arr.begin(), arr.end());
+    }
+    if (pv_type == "boolean") {
+	return static_cast<bool>(root.getSubFieldT<epics::pvData::PVBoolean>("value")->get());
+    }
+    auto scalar = root.getSubField<epics::pvData::PVScalar>("value");
+    if (not scalar) {
+	return std::nullopt;
+    }
+    if (pv_type == "string") {
+	return scalar->getAs<std::string>();
+    }
+    if (is_integer_type(pv_type)) {
+	return scalar->getAs<int>();
+    }
+    return scalar->getAs<double>();
+}
+
+Snapshot take_snapshot(pvac::ClientProvider &provider, const std::string &provider_name,
+		       const std::vector<std::string> &pv_names, double timeout, std::vector<std::string> &errors) {
+    // A get waits for its channel to connect, so connecting and reading
+    // every PV overlap
+    std::vector<pvac::ClientChannel> channels;
+    channels.reserve(pv_names.size());
+    for (const auto &pv_name : pv_names) {
+	channels.push_back(provider.connect(pv_name));
+    }
+    GetBatch batch(channels);
+    batch.wait(timeout);
+
+    Snapshot snapshot{provider_name, {}};
+    for (size_t i = 0; i < pv_names.size(); i++) {
+	const std::optional<pvac::GetEvent> evt = batch.event(i);
+	if (not evt) {
+	    errors.push_back(pv_names[i] + ": timed out");
+	    continue;
+	}
+	if (evt->event != pvac::GetEvent::Success or not evt->value) {
+	    errors.push_back(pv_names[i] + ": " + (evt->message.empty() ? "get failed" : evt->message));
+	    continue;
+	}
+	try {
+	    const std::string pv_type = evt->value->getStructure()->getField("value")->getID();
+	    if (auto value = value_of(*evt->value, pv_type)) {
+		snapshot.values.push_back(SnapshotValue{pv_names[i], pv_type, *value});
+	    } else {
+		errors.push_back(pv_names[i] + ": cannot restore values of type " + pv_type);
+	    }
+	} catch (const std::exception &e) {
+	    errors.push_back(pv_names[i] + ": " + e.what());
+	}
+    }
+    return snapshot;
+}
+
+// Returns a string quoted and escaped as TOML
+static std::string quoted(const std::string &str) {
+    std::ostringstream out;
+    out << toml::toml_formatter(toml::value<std::string>(str), toml::format_flags::none);
+    return out.str();
+}
+
+void save_snapshot(const Snapshot &snapshot, const std::string &path) {
+    std::ofstream out(path);
+    if (not out) {
+	throw std::runtime_error("Cannot write snapshot " + path);
+    }
+    // Enough digits that every double reads back exactly
+    out.precision(std::numeric_limits<double>::max_digits10);
+    out << "# pvkb snapshot, written back with 'pvkb restore " << path << "'\n";
+    out << "provider = " << quoted(snapshot.provider) << "\n\n[values]\n";
+    for (const auto &entry : snapshot.values) {
+	out << quoted(entry.pv_name) << " = { type = " << quoted(entry.pv_type) << ", value = ";
+	std::visit([&](auto &&arg) {
+	    using T = std::decay_t<decltype(arg)>;
+	    if constexpr (std::is_same_v<T, std::vector<double>>) {
+		out << "[";
+		for (size_t i = 0; i < arg.size(); i++) {
+		    out << (i == 0 ? "" : ", ") << arg[i];
+		}
+		out << "]";
+	    } else if constexpr (std::is_same_v<T, std::string>) {
+		out << quoted(arg);
+	    } else if constexpr (std::is_same_v<T, bool>) {
+		out << (arg ? "true" : "false");
+	    } else {
+		out << arg;
+	    }
+	}, entry.value);
+	out << " }\n";
+    }
+    if (not out.flush()) {
+	throw std::runtime_error("Cannot write snapshot " + path);
+    }
+}
+
+Snapshot load_snapshot(const std::string &path) {
+    const toml::table tbl = toml::parse_file(path);
+    auto values = tbl["values"].as_table();
+    if (not values) {
+	throw std::runtime_error(path + " is not a pvkb snapshot");
+    }
+
+    Snapshot snapshot{tbl["provider"].value_or(std::string("ca")), {}};
+    for (const auto &[name, node] : *values) {
+	const std::string pv_name(name.str());
+	auto entry = node.as_table();
+	if (not entry) {
+	    throw std::runtime_error("Invalid value of " + pv_name + " in snapshot " + path);
+	}
+	const std::string pv_type = (*entry)["type"].value_or(std::string());
+	const auto value = (*entry)["value"];
+	std::optional<TargetVar> target;
+	if (is_array_type(pv_type)) {
+	    if (auto arr = value.as_array()) {
+		std::vector<double> data;
+		for (const auto &item : *arr) {
+		    data.push_back(item.value_or(std::numeric_limits<double>::quiet_NaN()));
+		}
+		target = data;
+	    }
+	} else if (pv_type == "string") {
+	    if (auto str = value.value<std::string>()) {
+		target = *str;
+	    }
+	} else if (pv_type == "boolean") {
+	    if (auto flag = value.value<bool>()) {
+		target = *flag;
+	    }
+	} else if (pv_type == "enum_t" or is_integer_type(pv_type)) {
+	    if (auto num = value.value<int>()) {
+		target = *num;
+	    }
+	} else if (auto num = value.value<double>()) {
+	    target = *num;
+	}
+	if (pv_type.empty() or not target) {
+	    throw std::runtime_error("Invalid value of " + pv_name + " in snapshot " + path);
+	}
+	snapshot.values.push_back(SnapshotValue{pv_name, pv_type, *target});
+    }
+    return snapshot;
+}
+
+std::vector<PutAction> restore_actions(const Snapshot &snapshot, pvac::ClientProvider &provider) {
+    std::vector<PutAction> actions;
+    actions.reserve(snapshot.values.size());
+    for (const auto &entry : snapshot.values) {
+	PutAction action;
+	action.channel = provider.connect(entry.pv_name);
+	action.pv_name = entry.pv_name;
+	action.pv_type = entry.pv_type;
+	action.value = entry.value;
+	actions.push_back(std::move(action));
+    }
+    return actions;
+}
@@ -0,0 +1,42 @@
+#ifndef PVKB_SNAPSHOT_H
+#define PVKB_SNAPSHOT_H
+
+#include <string>
+#include <vector>
+
+#include <pva/client.h>
+
+#include "putops.h"
+
+// The value of one PV, in the type the PV takes
+struct SnapshotValue {
+    std::string pv_name;
+    std::string pv_type; // e.g. "double", "enum_t", or "double[]"
+    TargetVar value;
+};
+
+// Values of many PVs taken at one time, and the provider they were read with
+struct Snapshot {
+    std::string provider;
+    std::vector<SnapshotValue> values;
+};
+
+// Reads every PV with one get each. All connects and gets are started
+// before waiting on any, so thousands of PVs cost about one timeout rather
+// than one per PV. Adds a message to errors for every PV which could not
+// be read in timeout seconds, or whose type cannot be written back
+Snapshot take_snapshot(pvac::ClientProvider &provider, const std::string &provider_name,
+		       const std::vector<std::string> &pv_names, double timeout, std::vector<std::string> &errors);
+
+// Writes a snapshot as TOML with one line per PV, e.g.
+//   "ioc:m1.VAL" = { type = "double", value = 1.5 }
+// Throws if the file cannot be written
+void save_snapshot(const Snapshot &snapshot, const std::string &path);
+
+// Reads a file written by save_snapshot(). Throws if it is not a snapshot
+Snapshot load_snapshot(const std::string &path);
+
+// Returns the absolute puts which write a snapshot back
+std::vector<PutAction> restore_actions(const Snapshot &snapshot, pvac::ClientProvider &provider);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PVKB_SPSCRING_H
+#define PVKB_SPSCRING_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Fixed size lock-free ring buffer for exactly one producer thread and one
+// consumer thread. head_ is only written by the producer and tail_ only by
+// the consumer, each on its own cache line so the two threads never contend.
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity > 0 and (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+  public:
+    // Producer: appends an item, returns false if the ring is full
+    bool push(const T &item) {
+	const size_t head = head_.load(std::memory_order_relaxed);
+	const size_t tail = tail_.load(std::memory_order_acquire);
+	if (head - tail == Capacity) {
+	    return false;
+	}
+	buffer_[head & (Capacity - 1)] = item;
+	head_.store(head + 1, std::memory_order_release);
+
+	const size_t depth = head + 1 - tail;
+	if (depth > high_water_.load(std::memory_order_relaxed)) {
+	    high_water_.store(depth, std::memory_order_relaxed);
+	}
+	return true;
+    }
+
+    // Consumer: moves up to max items into out, returns the number moved
+    size_t pop(T *out, size_t max) {
+	const size_t tail = tail_.load(std::memory_order_relaxed);
+	const size_t head = head_.load(std::memory_order_acquire);
+	const size_t n = std::min(head - tail, max);
+	for (size_t i = 0; i < n; i++) {
+	    out[i] = buffer_[(tail + i) & (Capacity - 1)];
+	}
+	tail_.store(tail + n, std::memory_order_release);
+	return n;
+    }
+
+    // Returns the number of queued items, exact only from the producer or consumer
+    size_t size() const {
+	const size_t tail = tail_.load(std::memory_order_acquire);
+	return head_.load(std::memory_order_acquire) - tail;
+    }
+
+    // Returns the largest number of items that were ever queued at once
+    size_t high_water() const {
+	return high_water_.load(std::memory_order_relaxed);
+    }
+
+    static constexpr size_t capacity() {
+	return Capacity;
+    }
+
+  private:
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) std::atomic<size_t> high_water_{0};
+    std::array<T, Capacity> buffer_;
+};
+
+#endif
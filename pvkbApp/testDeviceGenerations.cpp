@@ -0,0 +1,39 @@
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "devicegen.h"
+
+// A jog of m1 queued before an urgent stop of m1 must not be sent after it
+static void testStopAfterQueuedJog() {
+    testDiag("stop after queued jog");
+    DeviceGenerations generations;
+    const uint64_t jog = generations.current();
+    testOk1(not generations.superseded(jog, "m1"));
+
+    generations.bump({"m1"});
+    testOk(generations.superseded(jog, "m1"), "jog queued before the stop is dropped");
+    testOk(not generations.superseded(jog, "m2"), "press for another device is kept");
+
+    const uint64_t after = generations.current();
+    testOk(not generations.superseded(after, "m1"), "jog queued after the stop is sent");
+}
+
+// Each stop only drops presses queued before it
+static void testRepeatedStops() {
+    testDiag("repeated stops");
+    DeviceGenerations generations;
+    generations.bump({"m1"});
+    const uint64_t first = generations.current();
+    generations.bump({"m2", "m3"});
+    testOk(not generations.superseded(first, "m1"), "m1 was not stopped again");
+    testOk(generations.superseded(first, "m3"), "m3 was stopped since");
+    generations.bump({"m1"});
+    testOk(generations.superseded(first, "m1"), "m1 was stopped again");
+}
+
+MAIN(testDeviceGenerations) {
+    testPlan(7);
+    testStopAfterQueuedJog();
+    testRepeatedStops();
+    return testDone();
+}
@@ -0,0 +1,69 @@
+#include <chrono>
+#include <vector>
+
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "putops.h"
+
+// Waveform length of the benchmark, a large detector or trajectory array
+static constexpr size_t length = 1000000;
+static constexpr int rounds = 20;
+
+// Returns a waveform holding 0, 1, 2, ...
+static epics::pvData::shared_vector<const double> ramp() {
+    epics::pvData::shared_vector<double> arr(length);
+    for (size_t i = 0; i < length; i++) {
+	arr[i] = static_cast<double>(i);
+    }
+    return epics::pvData::freeze(arr);
+}
+
+static void testScalarOffset() {
+    const auto current = ramp();
+    const auto result = increment_array(current, 0.5);
+    testOk(result.size() == length, "scalar offset keeps the length");
+    testOk(result[0] == 0.5 and result[length - 1] == length - 0.5, "scalar offset added to every element");
+    testOk(current[1] == 1.0, "current waveform is left alone");
+}
+
+static void testVectorOffset() {
+    const auto current = ramp();
+    std::vector<double> offsets(length, 2.0);
+    offsets[length / 2] = -1.0;
+    const auto result = increment_array(current, offsets);
+    testOk(result[0] == 2.0 and result[length / 2] == length / 2 - 1.0, "vector offset added element by element");
+
+    bool threw = false;
+    try {
+	increment_array(current, std::vector<double>(length - 1, 1.0));
+    } catch (const std::runtime_error &) {
+	threw = true;
+    }
+    testOk(threw, "offsets of the wrong length are rejected");
+}
+
+// Reports the cost of incrementing the whole waveform, as one keypress would
+static void benchIncrement() {
+    auto current = ramp();
+    const TargetVar offsets = std::vector<double>(length, 1.0);
+    const TargetVar offset = 1.0;
+    for (const bool vector : {false, true}) {
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; i++) {
+	    current = vector ? increment_array(current, offsets) : increment_array(current, offset);
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	testDiag("%s offset, %zu elements: %.3f ms per increment, %.2f GB/s", vector ? "vector" : "scalar", length,
+		 seconds / rounds * 1e3, (vector ? 3.0 : 2.0) * sizeof(double) * length * rounds / seconds / 1e9);
+    }
+    testOk(current[0] == 2.0 * rounds, "every increment chained on the one before");
+}
+
+MAIN(testIncrementArray) {
+    testPlan(6);
+    testScalarOffset();
+    testVectorOffset();
+    benchIncrement();
+    return testDone();
+}
@@ -0,0 +1,68 @@
+#include <chrono>
+#include <optional>
+#include <set>
+#include <string>
+
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "keynames.h"
+#include "keyseq.h"
+
+// Modifier prefixes a name may carry, every combination
+static const char *const prefixes[] = {"", "shift_", "alt_", "alt_shift_", "ctrl_", "ctrl_shift_", "ctrl_alt_",
+				       "ctrl_alt_shift_"};
+
+// Every name resolves to its code, with every combination of modifiers,
+// and the name logs and metrics show for the code resolves back to it.
+// The one combination giving code 0, ctrl_@, is rejected
+static void testEveryName() {
+    for (const auto &entry : key_names()) {
+	const std::string name(entry.name);
+	bool modified = true;
+	for (int modifiers = 0; modifiers < 8; modifiers++) {
+	    const int code = apply_modifiers(entry.code, modifiers);
+	    const std::optional<int> expected = code ? std::optional<int>(code) : std::nullopt;
+	    modified = modified and key_code(prefixes[modifiers] + name) == expected;
+	}
+	testOk(key_code(name) == entry.code and modified and key_code(key_label(entry.code)) == entry.code,
+	       "key_%s = %d", name.c_str(), entry.code);
+    }
+}
+
+static void testInvalidNames() {
+    testOk(not key_code("") and not key_code("ctrl_") and not key_code("alt-"), "empty names are rejected");
+    testOk(not key_code("f64") and not key_code("pgup") and not key_code("ctrl_ctrl"), "unknown names are rejected");
+    testOk(key_code("ctrl-alt-x") == key_code("ctrl_alt_x"), "modifiers may be joined by '-'");
+    testOk(not key_code("ctrl_@") and not key_code("ctrl-@") and key_code("ctrl_alt_@") == key_mod_alt,
+	   "ctrl_@ is rejected, code 0 stands for the put list");
+}
+
+// Reports the cost of resolving a name, which should not grow with the table
+static void benchLookup() {
+    static constexpr int rounds = 2000;
+    std::set<int> codes;
+    size_t lookups = 0;
+    int sum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+	for (const auto &entry : key_names()) {
+	    sum += key_code(entry.name).value_or(0);
+	    lookups++;
+	}
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (const auto &entry : key_names()) {
+	codes.insert(entry.code);
+    }
+    testDiag("%zu names for %zu key codes, %.1f ns per lookup (checksum %d)", key_names().size(), codes.size(),
+	     seconds / lookups * 1e9, sum);
+}
+
+MAIN(testKeyNames) {
+    testPlan(static_cast<int>(key_names().size()) + 4);
+    testEveryName();
+    testInvalidNames();
+    benchLookup();
+    return testDone();
+}
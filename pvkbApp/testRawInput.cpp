@@ -0,0 +1,88 @@
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <ncurses.h>
+
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "keynames.h"
+#include "keyproto.h"
+#include "rawinput.h"
+
+// Returns the keys decoded from bytes, fed one burst at a time
+static std::vector<int> decode(const std::vector<std::string> &bursts) {
+    EscapeDecoder decoder;
+    std::vector<KeyInput> out;
+    for (const auto &burst : bursts) {
+	decoder.feed(burst.data(), burst.size(), out);
+    }
+    decoder.flush(out);
+    std::vector<int> keys;
+    for (const auto &input : out) {
+	keys.push_back(input.key);
+    }
+    return keys;
+}
+
+static void testDecode() {
+    testOk(decode({"a\x1b[A\x1bOB\r"}) == std::vector<int>({'a', KEY_UP, KEY_DOWN, '\n'}), "plain keys and arrows");
+    testOk(decode({"\x1b[15~\x1bOP\x1b[3~"}) == std::vector<int>({KEY_F(5), KEY_F(1), KEY_DC}), "function and editing keys");
+    testOk(decode({"\x1b[1;5A\x1b[3;2~"})
+	   == std::vector<int>({apply_modifiers(KEY_UP, modifier_ctrl), apply_modifiers(KEY_DC, modifier_shift)}),
+	   "modified keys");
+    testOk(decode({"\x1bx"}) == std::vector<int>({apply_modifiers('x', modifier_alt)}), "alt+key");
+    testOk(decode({"\x1b[", "1", "5~"}) == std::vector<int>({KEY_F(5)}), "sequence split across reads");
+    testOk(decode({"\x1b"}) == std::vector<int>({0x1b}), "lone escape after the timeout");
+    testOk(decode({"\x1b[99;9zq"}) == std::vector<int>({'q'}), "unknown sequence dropped whole");
+}
+
+// Returns the keys decoded in kitty keyboard mode, with their event types
+static std::vector<std::pair<int, KeyEventType>> decode_kitty(const std::string &bytes) {
+    KittyDecoder decoder;
+    std::vector<std::pair<int, KeyEventType>> keys;
+    for (const char byte : bytes) {
+	if (auto input = decoder.feed(static_cast<unsigned char>(byte))) {
+	    keys.emplace_back(input->key, input->type);
+	}
+    }
+    return keys;
+}
+
+static void testKitty() {
+    // F13, keypad 5 released, keypad left with ctrl, then volume up which has no key
+    testOk(decode_kitty("\x1b[57376u\x1b[57404;1:3u\x1b[57417;5u\x1b[57439u")
+	   == std::vector<std::pair<int, KeyEventType>>({{KEY_F(13), KeyEventType::press},
+							{'5', KeyEventType::release},
+							{apply_modifiers(KEY_LEFT, modifier_ctrl), KeyEventType::press}}),
+	   "kitty function and keypad keys");
+}
+
+// Reports the decode cost per event of a burst of typical keys
+static void benchDecode() {
+    static constexpr int rounds = 100000;
+    const std::string burst = "j\x1b[A\x1b[1;5C\x1bOP\x1b[15~k\x1b[3~\x1bx";
+    EscapeDecoder decoder;
+    std::vector<KeyInput> out;
+    out.reserve(16);
+    size_t events = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+	out.clear();
+	decoder.feed(burst.data(), burst.size(), out);
+	events += out.size();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    testOk(events == rounds * 8u, "every key of the burst decoded");
+    testDiag("%zu events, %.1f ns per event", events, seconds / events * 1e9);
+}
+
+MAIN(testRawInput) {
+    testPlan(9);
+    testDecode();
+    testKitty();
+    benchDecode();
+    return testDone();
+}
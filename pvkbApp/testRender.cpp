@@ -0,0 +1,104 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <ncurses.h>
+
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "render.h"
+
+// One readback per binding, as on a screen of a large templated config
+static constexpr int bindings = 200;
+static constexpr int frames = 100;
+
+// Output bandwidth of a slow SSH link, in bytes per second
+static constexpr double link_bytes = 1e6 / 8;
+
+// Returns the bytes written to out so far
+static long written(FILE *out) {
+    std::fflush(out);
+    return std::ftell(out);
+}
+
+// Returns the readback text of a binding in a frame
+static std::string readback(int binding, int frame) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.3f", binding * 10.0 + frame * 0.001);
+    return text;
+}
+
+// Reports the cost per frame of the readbacks changing, against repainting everything
+static void benchFrames(FILE *out) {
+    Screen screen;
+    std::vector<Screen::FieldId> fields;
+    for (int i = 0; i < bindings; i++) {
+	mvaddstr(i, 0, ("key_" + std::to_string(i) + " = m" + std::to_string(i) + ".TWF").c_str());
+	fields.push_back(screen.add_field(i, 40, 20));
+    }
+    size_t length = 0;
+    for (int i = 0; i < bindings; i++) {
+	screen.set(fields[i], readback(i, 0));
+	length += readback(i, 0).length();
+    }
+    const size_t first_cells = screen.flush();
+    testOk(first_cells == length, "first frame draws every readback (%zu cells)", first_cells);
+
+    size_t cells = 0;
+    long bytes = written(out);
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 1; frame <= frames; frame++) {
+	for (int i = 0; i < bindings; i++) {
+	    screen.set(fields[i], readback(i, frame));
+	}
+	cells += screen.flush();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bytes = written(out) - bytes;
+    testOk(cells < static_cast<size_t>(frames) * bindings * 3, "only the changed digits are written (%zu cells)", cells);
+    testDiag("damage tracked: %.1f cells, %.0f bytes, %.1f us CPU, %.1f ms at 1 Mbit/s per frame",
+	     static_cast<double>(cells) / frames, static_cast<double>(bytes) / frames, seconds / frames * 1e6,
+	     bytes / link_bytes / frames * 1e3);
+
+    testOk(screen.flush() == 0, "a frame with no changes writes nothing");
+
+    // The same frames repainted in full, as a refresh() of the whole screen would
+    bytes = written(out);
+    start = std::chrono::steady_clock::now();
+    for (int frame = 1; frame <= frames; frame++) {
+	for (int i = 0; i < bindings; i++) {
+	    mvaddstr(i, 40, readback(i, frame + frames).c_str());
+	}
+	clearok(curscr, TRUE);
+	wrefresh(stdscr);
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bytes = written(out) - bytes;
+    testDiag("full repaint: %.0f bytes, %.1f us CPU, %.1f ms at 1 Mbit/s per frame",
+	     static_cast<double>(bytes) / frames, seconds / frames * 1e6, bytes / link_bytes / frames * 1e3);
+}
+
+MAIN(testRender) {
+    testPlan(3);
+
+    // Draw into a file standing in for the terminal, tall enough for every binding
+    setenv("LINES", std::to_string(bindings + 2).c_str(), 1);
+    setenv("COLUMNS", "100", 1);
+    FILE *out = std::tmpfile();
+    FILE *in = std::fopen("/dev/null", "r");
+    SCREEN *term = out and in ? newterm("xterm", out, in) : nullptr;
+    if (not term) {
+	testSkip(3, "no xterm terminfo entry");
+	return testDone();
+    }
+    set_term(term);
+    benchFrames(out);
+    endwin();
+    delscreen(term);
+    std::fclose(in);
+    std::fclose(out);
+    return testDone();
+}
@@ -0,0 +1,112 @@
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "trace.h"
+
+namespace tracing {
+
+static std::atomic<bool> enabled_{false};
+static std::mutex mutex_;
+static std::vector<Event> events_;
+static size_t dropped_ = 0;
+static Clock::time_point origin_;
+
+// Returns a small number naming the calling thread, trace viewers draw one row per thread
+static unsigned thread_number() {
+    static std::atomic<unsigned> next{1};
+    thread_local const unsigned number = next.fetch_add(1);
+    return number;
+}
+
+// Stores an event, or counts it as dropped once the buffer is full
+static void record(Event &&event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (events_.size() < max_events) {
+	events_.push_back(std::move(event));
+    } else {
+	dropped_++;
+    }
+}
+
+void enable() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not enabled_) {
+	origin_ = Clock::now();
+	enabled_ = true;
+    }
+}
+
+bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+void span(const char *category, const std::string &name, Clock::time_point begin, Clock::time_point end) {
+    if (enabled()) {
+	record(Event{name, category, begin, end - begin, false, thread_number()});
+    }
+}
+
+void instant(const char *category, const std::string &name) {
+    if (enabled()) {
+	record(Event{name, category, Clock::now(), Clock::duration::zero(), true, thread_number()});
+    }
+}
+
+std::vector<Event> events() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_;
+}
+
+size_t dropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+}
+
+// Returns str quoted as a JSON string
+static std::string json_string(const std::string &str) {
+    std::ostringstream ss;
+    ss << '"';
+    for (const char c : str) {
+	if (c == '"' or c == '\\') {
+	    ss << '\\' << c;
+	} else if (static_cast<unsigned char>(c) < 0x20) {
+	    ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+	} else {
+	    ss << c;
+	}
+    }
+    ss << '"';
+    return ss.str();
+}
+
+bool write(const std::string &path) {
+    std::ofstream out(path);
+    if (not out) {
+	return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int pid = static_cast<int>(getpid());
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < events_.size(); i++) {
+	const Event &event = events_[i];
+	const double ts = std::chrono::duration<double, std::micro>(event.begin - origin_).count();
+	out << (i > 0 ? ",\n" : "") << "{\"name\":" << json_string(event.name)
+	    << ",\"cat\":\"" << event.category << "\",\"pid\":" << pid << ",\"tid\":" << event.thread
+	    << ",\"ts\":" << ts;
+	if (event.instant) {
+	    out << ",\"ph\":\"i\",\"s\":\"t\"}";
+	} else {
+	    out << ",\"ph\":\"X\",\"dur\":" << std::chrono::duration<double, std::micro>(event.duration).count() << "}";
+	}
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":" << dropped_ << "}}\n";
+    return static_cast<bool>(out);
+}
+
+}
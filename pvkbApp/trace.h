@@ -0,0 +1,53 @@
+#ifndef PVKB_TRACE_H
+#define PVKB_TRACE_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Session-wide record of timed spans, e.g. connects, gets, puts and monitor
+// events, written out in the Chrome trace event format which chrome://tracing
+// and Perfetto load directly. Spans are recorded from any thread.
+// Nothing is recorded until enable() is called, so when tracing is off
+// each call costs a single atomic load
+namespace tracing {
+
+using Clock = std::chrono::steady_clock;
+
+// A span, or an instant event when duration is zero and instant is set
+struct Event {
+    std::string name;
+    const char *category;
+    Clock::time_point begin;
+    Clock::duration duration;
+    bool instant;
+    unsigned thread;
+};
+
+// Most events kept, later ones are counted as dropped
+constexpr size_t max_events = 1 << 20;
+
+// Starts recording, timestamps in the trace are relative to this call
+void enable();
+
+// Returns true if enable() was called
+bool enabled();
+
+// Records a span from begin until end
+void span(const char *category, const std::string &name, Clock::time_point begin, Clock::time_point end = Clock::now());
+
+// Records an event at one point in time
+void instant(const char *category, const std::string &name);
+
+// Returns a copy of every event recorded so far
+std::vector<Event> events();
+
+// Returns the number of events which did not fit in max_events
+size_t dropped();
+
+// Writes every event as a Chrome trace JSON file. Returns false if the file could not be written
+bool write(const std::string &path);
+
+}
+
+#endif
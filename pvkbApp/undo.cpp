@@ -0,0 +1,87 @@
+#include <algorithm>
+
+#include "undo.h"
+
+// Returns the put which writes back the cached value of an action's PV,
+// in the type the PV takes, or nullopt if nothing is cached
+static std::optional<PutAction> restore_action(const PutAction &action) {
+    if (not action.cache) {
+	return std::nullopt;
+    }
+    PutAction restore = action;
+    restore.increment = false;
+    restore.urgent = false;
+    if (is_array_type(action.pv_type)) {
+	auto arr = action.cache->array();
+	if (not arr) {
+	    return std::nullopt;
+	}
+	restore.value = std::vector<double>(arr->begin(), arr->end());
+    } else if (action.pv_type == "string") {
+	auto str = action.cache->string();
+	if (not str) {
+	    return std::nullopt;
+	}
+	restore.value = *str;
+    } else if (auto num = action.cache->number(); num and action.pv_type != "enum_t") {
+	if (action.pv_type == "boolean") {
+	    restore.value = *num != 0.0;
+	} else if (is_integer_type(action.pv_type)) {
+	    restore.value = static_cast<int>(*num);
+	} else {
+	    restore.value = *num;
+	}
+    } else {
+	return std::nullopt;
+    }
+    return restore;
+}
+
+UndoStack::UndoStack(size_t depth, std::chrono::steady_clock::duration merge_window)
+    : depth_(std::max<size_t>(1, depth)), merge_window_(merge_window) {}
+
+void UndoStack::record(const std::vector<PutAction> &actions, std::chrono::steady_clock::time_point now) {
+    std::vector<std::string> pv_names;
+    for (const auto &action : actions) {
+	pv_names.push_back(action.pv_name);
+    }
+    std::sort(pv_names.begin(), pv_names.end());
+    pv_names.erase(std::unique(pv_names.begin(), pv_names.end()), pv_names.end());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not entries_.empty() and now - entries_.back().last <= merge_window_ and entries_.back().pv_names == pv_names) {
+	// Keep the value from before the first of the rapid changes
+	entries_.back().last = now;
+	return;
+    }
+
+    Entry entry{{}, pv_names, now};
+    for (const auto &pv_name : pv_names) {
+	auto action = std::find_if(actions.begin(), actions.end(), [&](const auto &a) { return a.pv_name == pv_name; });
+	if (auto restore = restore_action(*action)) {
+	    entry.restore.push_back(std::move(*restore));
+	}
+    }
+    if (entry.restore.empty()) {
+	return;
+    }
+    entries_.push_back(std::move(entry));
+    if (entries_.size() > depth_) {
+	entries_.pop_front();
+    }
+}
+
+std::optional<std::vector<PutAction>> UndoStack::pop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.empty()) {
+	return std::nullopt;
+    }
+    std::vector<PutAction> restore = std::move(entries_.back().restore);
+    entries_.pop_back();
+    return restore;
+}
+
+size_t UndoStack::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
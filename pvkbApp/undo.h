@@ -0,0 +1,46 @@
+#ifndef PVKB_UNDO_H
+#define PVKB_UNDO_H
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "putops.h"
+
+// Bounded stack of the values puts overwrote, so the last change can be
+// undone with one key. The value before a put is taken from the PV's
+// monitor cache, which costs no round trip. Puts to the same PVs within
+// merge_window of each other, e.g. a key tapped ten times, collapse into
+// one entry which restores the value before the first of them.
+// Bindings are dispatched from the input and dispatch threads, so every
+// method takes a lock
+class UndoStack {
+  public:
+    UndoStack(size_t depth, std::chrono::steady_clock::duration merge_window);
+
+    // Records the current values of the PVs the actions are about to
+    // write. PVs without a cached value, e.g. not yet monitored or enums, are skipped
+    void record(const std::vector<PutAction> &actions, std::chrono::steady_clock::time_point now);
+
+    // Removes the latest entry and returns the puts which restore it, or nullopt if there is none
+    std::optional<std::vector<PutAction>> pop();
+
+    // Returns the number of entries
+    size_t size() const;
+
+  private:
+    struct Entry {
+	std::vector<PutAction> restore;
+	std::vector<std::string> pv_names; // every PV written, sorted
+	std::chrono::steady_clock::time_point last;
+    };
+
+    const size_t depth_;
+    const std::chrono::steady_clock::duration merge_window_;
+    mutable std::mutex mutex_;
+    std::deque<Entry> entries_;
+};
+
+#endif